@@ -0,0 +1,108 @@
+// Latency/throughput of the GDB transport: the blocking request/reply path
+// against the pipelined post/collect queue, over loopback TCP and a unix
+// socket, on a live qemu-system-riscv64.
+//
+//   make gdb-bench && ./build/gdb-bench cases/riscv-tests/rv64ui-p-add [iterations]
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qemu.h"
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const char *name, int iterations, int packets, double us) {
+    printf("%-32s %10.2f us/iter %12.0f packets/s\n",
+           name, us / iterations, packets * iterations / us * 1e6);
+}
+
+// the register snapshot as it was read before the pipelined path
+static void getregs_blocking(qemu_conn_t *conn, qemu_regs_t *r) {
+    gdb_send(conn, (const uint8_t *) "g", 1);
+    size_t size;
+    uint8_t *reply = gdb_recv(conn, &size);
+    uint8_t *p = reply;
+    uint8_t c;
+    for (int i = 0; i < 33 && (size_t) (i + 1) * 16 <= size; i++) {
+        c = p[16];
+        p[16] = '\0';
+        r->array[i] = gdb_decode_hex_str(p);
+        p[16] = c;
+        p += 16;
+    }
+    qemu_getfprs(conn, r);
+    qemu_getcsrs(conn, r);
+}
+
+static void bench(const char *transport, const char *elf, int servfd, int iterations) {
+    printf("== %s\n", transport);
+
+    double start = now_us();
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        close(0);
+        qemu_start_fd(elf, servfd);
+        panic("exec qemu");
+    }
+
+    qemu_conn_t *conn = qemu_connect_fd(servfd);
+    qemu_init(conn);
+    printf("%-32s %10.2f ms\n", "startup (fork to qemu_init)", (now_us() - start) / 1e3);
+
+    qemu_regs_t regs = {0};
+
+    start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        getregs_blocking(conn, &regs);
+    }
+    report("getregs (blocking)", iterations, 1 + 32 + csrs_count, now_us() - start);
+
+    start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        qemu_getregs(conn, &regs);
+    }
+    report("getregs (pipelined)", iterations, 1 + 32 + csrs_count, now_us() - start);
+
+    start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        // how the timer used to be kept from firing: mask mie.MTIE each step
+        uint64_t mie;
+        qemu_single_step(conn);
+        qemu_get_csr(conn, 3, &mie);
+        mie &= ~(1UL << 7);
+        qemu_set_csr(conn, 3, &mie);
+    }
+    report("step + mie mask (blocking)", iterations, 3, now_us() - start);
+
+    start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        qemu_single_step_noint(conn);
+    }
+    gdb_drain(conn);
+    report("step, -icount timer", iterations, 1, now_us() - start);
+
+    qemu_disconnect(conn);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        eprintf("usage: %s <elf> [iterations]\n", argv[0]);
+        return 1;
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+
+    bench("loopback TCP", argv[1], get_free_servfd(), iterations);
+    bench("unix socket", argv[1], get_free_unix_servfd(), iterations);
+    return 0;
+}
@@ -0,0 +1,156 @@
+// The hex codec of the GDB wire format (src/hex_codec.c) against the
+// byte-at-a-time code it replaced, on the register blocks the harness
+// exchanges: a `G` packet of the whole qemu_regs_t, a `g` reply of the 33
+// GPRs and pc, and the 16 digits of a `p` reply.  Both sides are checked
+// to agree first.
+//
+//   make hex-bench && ./build/hex-bench [iterations]
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hex_codec.h"
+#include "isa.h"
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// keeps the compiler from dropping the loops
+static volatile uint64_t sink;
+
+static void report(const char *name, int iterations, size_t bytes, double ns) {
+    printf("%-36s %10.1f ns/op %10.2f GB/s\n", name, ns / iterations, bytes * iterations / ns);
+}
+
+// the scalar code as it was
+static uint8_t old_hex_encode(uint8_t digit) {
+    return digit > 9 ? 'a' + digit - 10 : '0' + digit;
+}
+
+static uint8_t old_nibble(uint8_t hex) {
+    return isdigit(hex) ? hex - '0' : tolower(hex) - 'a' + 10;
+}
+
+static uint64_t old_decode_hex_str(const uint8_t *bytes) {
+    uint64_t value = 0;
+    uint64_t weight = 1;
+    while (isxdigit(bytes[0]) && isxdigit(bytes[1])) {
+        value += weight * (16 * old_nibble(bytes[0]) + old_nibble(bytes[1]));
+        bytes += 2;
+        weight *= 16 * 16;
+    }
+    return value;
+}
+
+static void old_encode_regs(char *buf, const qemu_regs_t *r) {
+    int p = 1;
+    buf[0] = 'G';
+    for (size_t i = 0; i < sizeof(qemu_regs_t); i++) {
+        p += sprintf(buf + p, "%c%c",
+                     old_hex_encode(((const uint8_t *) r)[i] >> 4),
+                     old_hex_encode(((const uint8_t *) r)[i] & 0xf));
+    }
+}
+
+static void old_decode_gprs(uint8_t *reply, size_t size, qemu_regs_t *r) {
+    uint8_t *p = reply;
+    for (int i = 0; i < 33 && (size_t) (i + 1) * 16 <= size; i++) {
+        uint8_t c = p[16];
+        p[16] = '\0';
+        r->array[i] = old_decode_hex_str(p);
+        p[16] = c;
+        p += 16;
+    }
+}
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("MISMATCH: %s\n", what);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    qemu_regs_t regs, out;
+    srand(1);
+    for (int i = 0; i < regs_count; i++) {
+        regs.array[i] = (uint64_t) rand() << 33 ^ (uint64_t) rand() << 11 ^ rand();
+    }
+
+    // a G packet, which holds a g reply in its first 33 * 16 digits
+    static char old_g[2 * sizeof(qemu_regs_t) + 2], new_g[2 * sizeof(qemu_regs_t) + 2];
+    old_encode_regs(old_g, &regs);
+    new_g[0] = 'G';
+    hex_encode_block((uint8_t *) new_g + 1, &regs, sizeof(regs));
+    new_g[1 + 2 * sizeof(regs)] = '\0';
+    check(!strcmp(old_g, new_g), "G packet");
+
+    uint8_t *reply = (uint8_t *) new_g + 1;
+    size_t size = 33 * 16;
+    // p replies come NUL-terminated
+    static uint8_t p_replies[33][17];
+    for (int i = 0; i < 33; i++) {
+        memcpy(p_replies[i], reply + 16 * i, 16);
+    }
+    memset(&out, 0, sizeof(out));
+    check(hex_decode_block(out.array, reply, 33 * 8) == 33 * 8 &&
+          !memcmp(out.array, regs.array, 33 * 8), "g reply");
+    for (int i = 0; i < 33; i++) {
+        check(hex_decode_le64(reply + 16 * i, 16) == regs.array[i], "p reply");
+    }
+    // short and malformed replies stop where the old decoder stopped
+    const char *odd[] = {"", "0", "1f", "1f2", "1fzz34", "E01", "xxxxxxxxxxxxxxxx", "0123456789ABCDEF",
+                         "0123456789abcdef0123", "0123456789abcdeg"};
+    for (size_t i = 0; i < sizeof(odd) / sizeof(odd[0]); i++) {
+        const uint8_t *s = (const uint8_t *) odd[i];
+        check(hex_decode_le64(s, strlen(odd[i])) == old_decode_hex_str(s), odd[i]);
+    }
+
+    double start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        old_encode_regs(old_g, &regs);
+        sink += old_g[i % sizeof(regs)];
+    }
+    report("G packet, sprintf per byte", iterations, sizeof(regs), now_ns() - start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        hex_encode_block((uint8_t *) new_g + 1, &regs, sizeof(regs));
+        sink += new_g[i % sizeof(regs)];
+    }
+    report("G packet, hex_encode_block", iterations, sizeof(regs), now_ns() - start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        old_decode_gprs(reply, size, &out);
+        sink += out.array[i % 33];
+    }
+    report("g reply, NUL-patched per register", iterations, 33 * 8, now_ns() - start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        hex_decode_block(out.array, reply, 33 * 8);
+        sink += out.array[i % 33];
+    }
+    report("g reply, hex_decode_block", iterations, 33 * 8, now_ns() - start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sink += old_decode_hex_str(p_replies[i % 33]);
+    }
+    report("p reply, gdb_decode_hex_str (old)", iterations, 8, now_ns() - start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        sink += hex_decode_le64(p_replies[i % 33], 16);
+    }
+    report("p reply, hex_decode_le64", iterations, 8, now_ns() - start);
+    return 0;
+}
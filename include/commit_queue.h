@@ -0,0 +1,72 @@
+#ifndef COMMIT_QUEUE_H
+#define COMMIT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Bounded single-producer/single-consumer queue from the DUT thread to the
+// checker thread of --pipeline.  Records are filled and read in place.
+// Either side can close it: the producer when the DUT stops, the consumer
+// when it found a mismatch, which makes the producer stop at its next push.
+template <typename T>
+class CommitQueue {
+public:
+    explicit CommitQueue(size_t depth) : slots(depth), head(0), tail(0), closed(false) {}
+
+    // the slot to fill next, waits while the queue is full.  NULL once the
+    // consumer closed the queue.
+    T *back() {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        while (h - tail.load(std::memory_order_acquire) >= slots.size()) {
+            if (closed.load(std::memory_order_acquire)) {
+                return NULL;
+            }
+            std::this_thread::yield();
+        }
+        return closed.load(std::memory_order_relaxed) ? NULL : &slots[h % slots.size()];
+    }
+
+    // publish the slot of back()
+    void push() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // the oldest record, waits while the queue is empty.  NULL once it is
+    // empty and closed.
+    T *front() {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        while (head.load(std::memory_order_acquire) == t) {
+            if (closed.load(std::memory_order_acquire)) {
+                // a push may have come before the close
+                if (head.load(std::memory_order_acquire) != t) {
+                    break;
+                }
+                return NULL;
+            }
+            std::this_thread::yield();
+        }
+        return &slots[t % slots.size()];
+    }
+
+    // done with the record of front()
+    void pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> slots;
+    // each on its own cache line, written by one side only
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<bool> closed;
+};
+
+#endif
@@ -5,6 +5,99 @@
 #ifndef ZJV2_DIFFTEST_DIFFTEST_H
 #define ZJV2_DIFFTEST_DIFFTEST_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// result of difftest() when the cycle budget ran out
+#define DIFFTEST_CYCLE_BUDGET 2
+
+// stop with DIFFTEST_CYCLE_BUDGET after this many DUT cycles, 0 = never
+extern uint64_t difftest_max_cycles;
+
+// lazy comparison: between two full comparisons, this many commit groups
+// apart, only the register written back and the trap causes are checked.
+// 0 = compare everything after every commit group
+extern uint64_t difftest_full_interval;
+
+// coarse lockstep: both sides run about this many instructions before they
+// are compared.  A diverging interval is replayed commit by commit from its
+// start to find the faulting instruction.  0 = compare every commit group
+extern uint64_t difftest_lockstep_interval;
+
+// run the DUT on its own thread, up to this many commit groups ahead of a
+// checker thread that drives the reference and compares.  0 = one thread,
+// the DUT waits for every comparison
+extern uint64_t difftest_pipeline_depth;
+
+// compare the memory the DUT stored to (memcheck.h) with the reference's at
+// the first full comparison after this many instructions, and at the end.
+// 0 = registers only
+extern uint64_t difftest_mem_interval;
+
+// shared library implementing the reference ABI of ref.h to run against
+// instead of QEMU, NULL = QEMU
+extern const char *difftest_ref_plugin;
+
+// QEMU TCG plugin (plugin/difftest_ring.c) to let QEMU run freely and stream
+// its retired instructions through shared memory instead of single-stepping
+// it over GDB.  A run the stream can't follow, or that doesn't pass, is run
+// again over GDB.  NULL = GDB only
+extern const char *difftest_ring_plugin;
+
+// keep a waveform of the last this many DUT cycles in memory and write it
+// to sim-window.vcd on a mismatch, too many bubbles, SIGINT or SIGUSR1.
+// 0 = no tracing at all
+extern uint64_t difftest_wave_window;
+
+// stream the waveform to sim.vcd (sim.fst with make WAVE_FORMAT=fst) from a
+// trigger on: "cycle:N", "inst:N" or "pc:ADDR", optionally "+CYCLES" long.
+// NULL = don't trace
+extern const char *difftest_wave_trigger;
+
+// write the DUT's performance counters to samples.csv every "cycle:N" or
+// "inst:N", NULL = don't sample.  difftest_sample_phases tags the rows with
+// the program phase, a comma separated list of NAME=LO-HI pc ranges.
+extern const char *difftest_sample_every;
+extern const char *difftest_sample_phases;
+
+// directory of golden reference traces (golden.h): a run of an ELF with a
+// trace there compares against it without starting QEMU, a passing run of
+// one without records it.  NULL = always run the reference
+extern const char *difftest_golden_dir;
+
+// a QEMU kept running across difftest() calls, to be reloaded with each
+// ELF instead of starting one per run.  NULL = start one per run
+extern struct gdb_conn *difftest_qemu;
+// the shared memory of its DRAM
+extern int difftest_qemu_dram;
+
+// start a QEMU for difftest_qemu, without an image, its DRAM in the shared
+// memory *dram and its output in log.  It dies with the caller.
+struct gdb_conn *difftest_start_pooled(const char *log, int *pid, int *dram);
+
+// reach QEMU's gdbstub over loopback TCP instead of a unix socket
+extern bool difftest_gdb_tcp;
+
+// run the DUT alone, nothing to compare against
+extern bool difftest_no_diff;
+
+// print both sides after every instruction
+extern bool difftest_commit_trace;
+
+// print IPC and stall counters, GDB transport statistics at the end
+extern bool difftest_ipc_stats;
+extern bool difftest_gdb_stats;
+
+// what the last difftest() got through, for the `emulator --run` summary
+typedef struct {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t ref_packets;   // GDB packets sent to QEMU, 0 for a plugin
+    bool qemu_idle;         // difftest_qemu was left stopped, nothing in flight
+} difftest_stats_t;
+
+extern difftest_stats_t difftest_stats;
+
 int difftest(const char *path);
 
 #endif //ZJV2_DIFFTEST_DIFFTEST_H
@@ -4,7 +4,8 @@
 #include <stdbool.h>
 #include "qemu.h"
 #include "VTileForVerilator.h"
-#include "verilated_vcd_c.h"
+#include "wave.h"
+#include "prof.h"
 
 typedef struct {
     uint64_t mycpu_pcs[3];
@@ -14,16 +15,108 @@ typedef struct {
     uint8_t mycpu_mmios[3];
 } diff_mmios;
 
-// #define TRACE
+// a cycle with commits, as dut_run() captured it
+typedef struct {
+    diff_pcs pcs;
+    uint64_t wdata;
+    uint64_t mcause, scause;
+    int n;                  // instructions committed, 0 after too many bubbles
+    int wdest;              // register written back, 0 = none
+    bool mmio;              // the write-back is an MMIO load
+    bool intr;              // the DUT took the timer interrupt
+} dut_group_t;
+
+// capacity of dut_groups
+#define DUT_RUN_MAX     64
+// cycles without a commit before dut_run() gives up waiting
+#define DUT_MAX_BUBBLES 200
+
+// why dut_run() returned
+enum {
+    DUT_RUN_GROUPS,         // max_groups captured, or the last one needs a look
+    DUT_RUN_FINISH,         // the core finished, in a cycle not captured
+    DUT_RUN_BUBBLES,        // too many bubbles, the last group is empty
+    DUT_RUN_CYCLES,         // the cycle budget is used up
+};
 
 extern VTileForVerilator *dut;
+extern dut_group_t dut_groups[DUT_RUN_MAX];
 
 // TODO sync cycle and sync interrupt
-void dut_reset(int cycle, VerilatedVcdC *vfp, VerilatedContext *context);  // reset processor and initialize memory
+void dut_reset(int cycle, Wave *wave, VerilatedContext *context);  // reset processor and initialize memory
 int dut_commit();  // if the processor has new commit
-void dut_step(int cycle, VerilatedVcdC *vfp, VerilatedContext *context);
+// the wave check compiles out of dut_step<false>, for the hot loop
+template <bool WAVE = true>
+inline void dut_step(int cycle, Wave *wave, VerilatedContext *context) {
+    ProfScope prof(PROF_DUT);
+    for (int i = 0; i < cycle; i++) {
+        dut->clock = 0;
+        dut->eval();
+        context->timeInc(1);
+        if (WAVE && wave) wave->dump(context->time());
+        dut->clock = 1;
+        dut->eval();
+        context->timeInc(1);
+        if (WAVE && wave) wave->dump(context->time());
+    }
+}
+
+// clock the model until max_groups (<= DUT_RUN_MAX) commit groups are
+// captured into dut_groups[0..*groups-1], and return early after a group
+// with an MMIO load, an interrupt or a change of the trap causes: the
+// caller may need the model's state right after it.  The ports are only
+// read once per cycle, with no calls in between.  max_cycles 0 = no budget
+template <bool WAVE = true>
+inline int dut_run(int max_groups, uint64_t max_cycles, int *groups, Wave *wave, VerilatedContext *context) {
+    ProfScope prof(PROF_DUT);
+    uint64_t mcause = dut->io_difftest_csrs_mcause, scause = dut->io_difftest_csrs_scause;
+    int bubbles = 0;
+    *groups = 0;
+    while (1) {
+        if (max_cycles && context->time() / 2 >= max_cycles) {
+            return DUT_RUN_CYCLES;
+        }
+        dut->clock = 0;
+        dut->eval();
+        context->timeInc(1);
+        if (WAVE && wave) wave->dump(context->time());
+        dut->clock = 1;
+        dut->eval();
+        context->timeInc(1);
+        if (WAVE && wave) wave->dump(context->time());
+
+        if (dut->io_difftest_finish) {
+            return DUT_RUN_FINISH;
+        }
+        int n = (dut->io_difftest_valids_0 != 0) + (dut->io_difftest_valids_1 != 0) +
+                (dut->io_difftest_valids_2 != 0);
+        if (n == 0 && ++bubbles <= DUT_MAX_BUBBLES) {
+            continue;
+        }
+
+        dut_group_t *g = &dut_groups[(*groups)++];
+        g->n = n;
+        g->pcs.mycpu_pcs[0] = dut->io_difftest_pcs_0;
+        g->pcs.mycpu_pcs[1] = dut->io_difftest_pcs_1;
+        g->pcs.mycpu_pcs[2] = dut->io_difftest_pcs_2;
+        g->wdest = dut->io_difftest_we ? dut->io_difftest_wdest : 0;
+        g->wdata = dut->io_difftest_wdata;
+        g->mmio = (dut->io_difftest_mmio_0 || dut->io_difftest_mmio_1 || dut->io_difftest_mmio_2) &&
+                  dut->io_difftest_we;
+        g->intr = dut->io_difftest_int;
+        g->mcause = dut->io_difftest_csrs_mcause;
+        g->scause = dut->io_difftest_csrs_scause;
+        if (n == 0) {
+            return DUT_RUN_BUBBLES;
+        }
+        bubbles = 0;
+        if (*groups == max_groups || g->mmio || g->intr || g->mcause != mcause || g->scause != scause) {
+            return DUT_RUN_GROUPS;
+        }
+    }
+}
+
 void dut_getregs(qemu_regs_t *regs);
-void dut_write_counter(int value);
 void dut_getpcs(diff_pcs *pcs);
 void dut_getmmios(diff_mmios *mmios);
 void dut_sync_reg(int saddr, int svalue, bool sync);
@@ -0,0 +1,40 @@
+#ifndef ELF_IMAGE_H
+#define ELF_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A RV64 ELF mapped read-only, reduced to what a loader needs: its PT_LOAD
+// segments.  Both sides load the test from it, the DUT through
+// testfile.hex and a reused QEMU through GDB writes.
+
+#define ELF_IMAGE_SEGS 16
+
+// filesz bytes at data, then zeros up to memsz
+typedef struct {
+    uint64_t paddr;
+    const uint8_t *data;
+    uint64_t filesz;
+    uint64_t memsz;
+} elf_seg_t;
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    uint64_t entry;
+    int nsegs;
+    elf_seg_t segs[ELF_IMAGE_SEGS];
+} elf_image_t;
+
+// NULL, after saying why, if path isn't a RV64 ELF
+elf_image_t *elf_image_open(const char *path);
+
+void elf_image_close(elf_image_t *image);
+
+// the DUT's memory image for $readmemh, what `objcopy -O binary` and
+// `od -t x1 -An -w1 -v` made of the ELF: a byte per entry from the lowest
+// segment to the end of the last one's file part, gaps zeroed
+bool elf_image_write_hex(const elf_image_t *image, const char *path);
+
+#endif
@@ -21,12 +21,26 @@
 #define GDB_PROTO_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "isa.h"
 
 struct gdb_conn;
 
+// transport counters of one connection
+struct gdb_stats {
+  uint64_t packets_sent;
+  uint64_t packets_recv;
+  uint64_t bytes_sent;     // including ACKs and packet framing
+  uint64_t bytes_recv;
+  uint64_t flushes;        // write() syscalls issued for packets and ACKs
+  uint64_t reads;          // read() syscalls
+  uint64_t bad_checksums;
+  uint64_t acks_saved;     // '+' bytes not exchanged thanks to no-ack mode
+  uint64_t syscalls_saved; // ACK flushes and ACK waits skipped in no-ack mode
+};
+
 uint16_t gdb_decode_hex(uint8_t msb, uint8_t lsb);
 
 inst_t gdb_decode_inst(uint8_t *bytes);
@@ -38,13 +52,57 @@ uint8_t hex_encode(uint8_t digit);
 struct gdb_conn *gdb_server_start(uint16_t port);
 struct gdb_conn *gdb_begin_server(int fd); // work at given fd
 struct gdb_conn *gdb_begin_inet(const char *addr, uint16_t port);
+// connect to a listening socket we created and handed to the server
+struct gdb_conn *gdb_begin_listener(int listen_fd);
+
+// listening endpoints for a server we start ourselves, see gdb_bridge.c
+int get_free_servfd();                // loopback TCP, on a free port
+int get_free_unix_servfd();           // abstract unix socket
+int get_port_of_servfd(int fd);
 
 void gdb_end(struct gdb_conn *conn);
 
 void gdb_send(struct gdb_conn *conn, const uint8_t *command, size_t size);
 
+// the reply is NUL-terminated and owned by the connection, it stays valid
+// until the next gdb_recv()/gdb_collect() on the same connection
 uint8_t *gdb_recv(struct gdb_conn *conn, size_t *size);
 
+// pipelined requests: packets are queued with gdb_post() and go out in one
+// write on the next gdb_flush()/gdb_collect(), which returns the replies in
+// posting order.  The blocking gdb_send()/gdb_recv() pair must not be used
+// while requests are still in flight.
+//
+// NB: QEMU takes any byte that arrives while the target runs as a ^C and
+// drops it, so a resume (step/continue) must be the last packet posted
+// before its reply is collected.
+void gdb_post(struct gdb_conn *conn, const uint8_t *command, size_t size);
+
+// like gdb_post(), but the reply is dropped (error replies are reported)
+void gdb_post_discard(struct gdb_conn *conn, const uint8_t *command, size_t size);
+
+void gdb_flush(struct gdb_conn *conn);
+
+uint8_t *gdb_collect(struct gdb_conn *conn, size_t *size);
+
+// gdb_collect() giving up after timeout_ms, returns NULL if nothing arrived
+// and the request stays pending
+uint8_t *gdb_collect_timeout(struct gdb_conn *conn, size_t *size, int timeout_ms);
+
+// stop a running target, the pending resume request then gets its reply
+void gdb_interrupt(struct gdb_conn *conn);
+
+// wait for the replies of all the discarded requests
+void gdb_drain(struct gdb_conn *conn);
+
+size_t gdb_pending(struct gdb_conn *conn);
+
+// negotiate QStartNoAckMode, returns "OK" or "" if the server refused and
+// the connection stays in ack mode
 const char * gdb_start_noack(struct gdb_conn *conn);
 
+bool gdb_acking(struct gdb_conn *conn);
+
+const struct gdb_stats *gdb_get_stats(struct gdb_conn *conn);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "isa.h"
+
+// Golden reference traces.  The reference is deterministic for a given ELF,
+// so the states it went through can be recorded once and compared against
+// in later runs without starting it.  A trace holds the initial state and
+// one record per retired instruction with the registers it changed, pc and
+// trap CSRs included, delta-encoded.  Points that depend on the DUT, the
+// interrupts it took and the MMIO values it read, are records of their own
+// that a later run has to match.
+
+// the record follows ref_enable_int(): the instruction took the interrupt
+#define GOLDEN_INT  1
+// not an instruction: the harness wrote the registers (MMIO sync)
+#define GOLDEN_SYNC 2
+
+typedef struct golden golden_t;
+
+// <dir>/<hash of the ELF's contents>.golden, malloc()ed
+char *golden_path(const char *dir, const char *elf);
+
+// record into path, the file only appears there with golden_finish()
+golden_t *golden_create(const char *path, const qemu_regs_t *initial);
+
+void golden_append(golden_t *g, int flags, const qemu_regs_t *regs);
+
+// move the trace into place, or throw it away
+void golden_finish(golden_t *g, bool keep);
+
+// map a trace for replay, NULL if there is none or it isn't valid
+golden_t *golden_open(const char *path);
+
+// the state after the records read so far
+const qemu_regs_t *golden_state(golden_t *g);
+
+// apply the next record, false at the end of the trace
+bool golden_next(golden_t *g, int *flags);
+
+void golden_close(golden_t *g);
+
+#endif
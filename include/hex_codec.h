@@ -0,0 +1,24 @@
+#ifndef HEX_CODEC_H
+#define HEX_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The hex encoding of the GDB remote protocol: two lowercase digits per
+// byte, bytes in memory order, so that a register block is the hex of the
+// little-endian qemu_regs_t as it lies in memory.  Blocks go 32 digits at
+// a time with AVX2 where the CPU has it, 16 with SSE2 otherwise, and the
+// rest a byte at a time.  Nothing here writes a NUL.
+
+// the 2 * n digits of the n bytes at src
+void hex_encode_block(uint8_t *dst, const void *src, size_t n);
+
+// n bytes from the 2 * n digits at src, the number decoded before the
+// first pair that isn't hex (dst isn't written from there on)
+size_t hex_decode_block(void *dst, const uint8_t *src, size_t n);
+
+// the little-endian value of the hex at src, of which len bytes can be
+// read: pairs up to the first one that isn't hex, at most 8
+uint64_t hex_decode_le64(const uint8_t *src, size_t len);
+
+#endif
@@ -38,6 +38,9 @@ typedef union {
     };
 } qemu_regs_t;
 
+// register names, indexed like qemu_regs_t.array
+extern const char *regs_alias[regs_count];
+
 
 // instructions
 typedef union {
@@ -0,0 +1,34 @@
+#ifndef MEMCHECK_H
+#define MEMCHECK_H
+
+#include <stdint.h>
+
+#include "ref.h"
+
+// Memory comparison.  The DUT reports every store it commits, and the bytes
+// stored are kept in a shadow of its memory by 4 KiB page.  At a comparison
+// only the pages stored to since the last one are read from the reference,
+// and only the bytes the DUT stored are checked.  The RTL declares
+//
+//   import "DPI-C" function void difftest_store_commit(
+//       input longint addr, input longint data, input byte mask);
+//
+// and calls it in the cycle the store commits, AMOs included: addr is
+// 8-byte aligned, bit i of mask is set if byte i of data was written.
+
+extern "C" void difftest_store_commit(long long addr, long long data, char mask);
+
+// track the DUT's stores from now on, forgetting those of an earlier run
+void memcheck_start();
+
+void memcheck_stop();
+
+// check the pages stored to since the last call against the reference,
+// false after printing the bytes that differ.  A reference that can't read
+// memory turns the comparison off.
+bool memcheck_compare(ref_t *ref);
+
+// stores reported since memcheck_start()
+uint64_t memcheck_stores();
+
+#endif
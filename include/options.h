@@ -0,0 +1,48 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <getopt.h>
+
+// command line options of a single difftest, shared by `emulator` and
+// `emulator --run`.  They set the difftest_* knobs of difftest.h.
+
+enum {
+    OPT_TCP = 256,
+    OPT_NO_DIFF,
+    OPT_COMMIT_TRACE,
+    OPT_IPC,
+    OPT_GDB_STATS,
+    OPT_PHASES,
+    OPT_PROFILE,
+    OPT_RING,
+};
+
+#define DIFFTEST_SHORT_OPTIONS "c:f:l:P:M:r:W:T:S:G:"
+
+#define DIFFTEST_LONG_OPTIONS                                       \
+    {"max-cycles",   required_argument, NULL, 'c'},                 \
+    {"full-every",   required_argument, NULL, 'f'},                 \
+    {"lockstep",     required_argument, NULL, 'l'},                 \
+    {"pipeline",     required_argument, NULL, 'P'},                 \
+    {"mem-check",    required_argument, NULL, 'M'},                 \
+    {"ref",          required_argument, NULL, 'r'},                 \
+    {"wave",         required_argument, NULL, 'W'},                 \
+    {"trace",        required_argument, NULL, 'T'},                 \
+    {"sample",       required_argument, NULL, 'S'},                 \
+    {"phases",       required_argument, NULL, OPT_PHASES},          \
+    {"golden",       required_argument, NULL, 'G'},                 \
+    {"ring",         required_argument, NULL, OPT_RING},            \
+    {"tcp",          no_argument,       NULL, OPT_TCP},             \
+    {"no-diff",      no_argument,       NULL, OPT_NO_DIFF},         \
+    {"commit-trace", no_argument,       NULL, OPT_COMMIT_TRACE},    \
+    {"ipc",          no_argument,       NULL, OPT_IPC},             \
+    {"gdb-stats",    no_argument,       NULL, OPT_GDB_STATS},       \
+    {"profile",      no_argument,       NULL, OPT_PROFILE}
+
+// apply one option returned by getopt_long(), false if it isn't one of these
+bool difftest_option(int opt, const char *arg);
+
+// their part of a usage message
+extern const char *difftest_options_help;
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "common.h"
+
+// self-profiling of the harness (--profile): where the wall time of a run
+// goes, and how long GDB packets take to be answered.  With prof_enabled
+// off, every probe is a single predictable branch.
+
+enum {
+    PROF_DUT,       // dut_step(): Verilator eval() and waveform dumps
+    PROF_REF,       // the reference: GDB round trips or plugin calls
+    PROF_HEX,       // decoding GDB replies, part of PROF_REF
+    PROF_COMPARE,   // comparing the two register files
+    PROF_SECTIONS,
+};
+
+extern bool prof_enabled;
+
+static ALWAYS_INLINE uint64_t prof_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+void prof_add(int section, uint64_t ticks);
+
+// the reply to a packet starting with `type` arrived `ticks` after it was sent
+void prof_packet(uint8_t type, uint64_t ticks);
+
+#define PROF_BEGIN() (UNLIKELY(prof_enabled) ? prof_ticks() : 0)
+#define PROF_END(section, start)                                \
+    do {                                                        \
+        if (UNLIKELY(prof_enabled))                             \
+            prof_add(section, prof_ticks() - (start));          \
+    } while (0)
+
+// start the clock of the run, everything before is not accounted
+void prof_start(void);
+
+// print the breakdown so far, with the simulation rates
+void prof_report(uint64_t instructions, uint64_t cycles);
+
+#ifdef __cplusplus
+// times the enclosing scope into a section
+class ProfScope {
+public:
+    explicit ProfScope(int section) : section(section), start(PROF_BEGIN()) {}
+    ~ProfScope() { PROF_END(section, start); }
+
+private:
+    int section;
+    uint64_t start;
+};
+#endif
+
+#endif
@@ -11,18 +11,74 @@ int qemu_start(const char *elf, int port);
 
 qemu_conn_t *qemu_connect(int port);
 
+// start QEMU with its gdbstub on a socket we are listening on (see
+// get_free_servfd() and get_free_unix_servfd()), the fd must not be CLOEXEC.
+int qemu_start_fd(const char *elf, int listen_fd);
+
+// shared memory the size of QEMU's DRAM, named into name, for
+// qemu_start_pooled().  The fd, or -1.
+int qemu_dram_create(char *name, size_t len);
+
+// like qemu_start_fd(), without an image, for qemu_load_elf(): its DRAM is
+// the shared memory dram of qemu_dram_create(), which it starts from zeros
+int qemu_start_pooled(const char *dram, int listen_fd);
+
+// start QEMU without a gdbstub, running freely with the difftest ring
+// plugin (plugin/difftest_ring.c) publishing into the shared memory shm
+int qemu_start_ring(const char *elf, const char *plugin, const char *shm, uint64_t entry);
+
+// connect to the gdbstub of qemu_start_fd(), takes over listen_fd
+qemu_conn_t *qemu_connect_fd(int listen_fd);
+
 void qemu_disconnect(qemu_conn_t *conn);
 
-// bool qemu_memcpy_to_qemu_small(qemu_conn_t *conn, uint32_t dest, void *src, int len);
+// transport statistics of the connection, normalized by retired instructions
+void qemu_print_stats(qemu_conn_t *conn, uint64_t instructions);
+
+// write len bytes of src to QEMU's memory at dest, zeros when src is NULL.
+// Pipelined, a round trip per 64 KiB.
+bool qemu_memcpy_to_qemu(qemu_conn_t *conn, uint64_t dest, const void *src, size_t len);
+
+// read len bytes of QEMU's memory at src, pipelined like
+// qemu_memcpy_to_qemu().  Binary `x` reads where QEMU has them, hex `m`
+// otherwise.
+bool qemu_memcpy_from_qemu(qemu_conn_t *conn, void *dest, uint64_t src, size_t len);
 
-// bool qemu_memcpy_to_qemu(qemu_conn_t *conn, uint32_t dest, void *src, int len);
+// run a command of QEMU's monitor (qRcmd), true if it succeeded
+bool qemu_monitor(qemu_conn_t *conn, const char *cmd);
+
+// reset the machine, load the PT_LOAD segments of elf into its memory and
+// zero what earlier tests left in the rest of DRAM, for a QEMU of
+// qemu_start_pooled() that keeps running across tests, dram its fd.  Its
+// hart then sits at the reset vector.  The target description of
+// qemu_init() still applies.
+bool qemu_load_elf(qemu_conn_t *conn, int dram, const char *elf);
 
 void qemu_getregs(qemu_conn_t *conn, qemu_regs_t *r);
 
+// fetch only r->array[idx[0..n-1]], in one pipelined round trip
+void qemu_getregs_subset(qemu_conn_t *conn, qemu_regs_t *r, const int *idx, int n);
+
 bool qemu_setregs(qemu_conn_t *conn, qemu_regs_t *r);
 
 bool qemu_single_step(qemu_conn_t *conn);
 
+// step one instruction, which takes the timer interrupt only after
+// qemu_enable_int().  QEMU runs with -icount, its own timer lags the DUT's
+// and doesn't fire by itself.  One round trip.
+bool qemu_single_step_noint(qemu_conn_t *conn);
+
+// advance over the n instructions the DUT committed at pcs[0..n-1], with the
+// timer interrupt handled as in qemu_single_step_noint().  Runs to a
+// breakpoint on the last one when that is safe, so the cost doesn't grow
+// with n.  Returns false if QEMU didn't follow the DUT's path.
+bool qemu_step_n(qemu_conn_t *conn, const uint64_t *pcs, int n);
+
+// run freely until the hits-th time pc stop is executed, starting with the
+// instruction at first.  Costs two round trips per hit instead of one per
+// instruction, the timer interrupt is handled as in qemu_single_step_noint()
+bool qemu_run_to(qemu_conn_t *conn, uint64_t first, uint64_t stop, uint32_t hits);
+
 void qemu_break(qemu_conn_t *conn, uint64_t entry);
 
 void qemu_remove_breakpoint(qemu_conn_t *conn, uint64_t entry);
@@ -45,8 +101,8 @@ bool qemu_set_csr(qemu_conn_t *conn, int csr_num, uint64_t *data);
 
 void qemu_init(qemu_conn_t *conn);
 
-void qemu_disable_int(qemu_conn_t *conn);
-
+// the DUT took the timer interrupt: move QEMU's mtime up to its mtimecmp so
+// that the next step takes it too.  One round trip, to read the two.
 void qemu_enable_int(qemu_conn_t *conn);
 
 #endif
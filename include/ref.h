@@ -0,0 +1,108 @@
+#ifndef REF_H
+#define REF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "golden.h"
+#include "qemu.h"
+#include "ring.h"
+
+// Reference model plugin ABI.  Instead of QEMU behind the GDB remote
+// protocol, the reference can be a shared library exporting the C symbols
+// below, loaded with dlopen() and driven through direct calls.  Registers
+// are exchanged in the qemu_regs_t layout, CSRs included.
+
+#define REF_ABI_VERSION 1
+
+// mcause of the machine timer interrupt
+#define MIP_MTIP_CAUSE ((1UL << 63) | 7)
+
+// direction of difftest_ref_regcpy() and difftest_ref_memcpy()
+#define REF_TO_DUT 0
+#define REF_TO_REF 1
+
+// int  difftest_ref_abi_version(void);
+//      REF_ABI_VERSION the plugin was built against
+// bool difftest_ref_init(const char *image, uint64_t entry);
+//      load the ELF image and stop at entry, with all GPRs zero
+// void difftest_ref_exec(uint64_t n);
+//      execute n instructions
+// void difftest_ref_regcpy(qemu_regs_t *regs, int direction);
+// void difftest_ref_memcpy(uint64_t addr, void *buf, size_t n, int direction);
+// void difftest_ref_raise_intr(uint64_t cause);
+//      the next difftest_ref_exec() starts by taking this interrupt, as the
+//      DUT did.  Otherwise the model must not take interrupts by itself.
+typedef struct {
+    int  (*abi_version)(void);
+    bool (*init)(const char *image, uint64_t entry);
+    void (*exec)(uint64_t n);
+    void (*regcpy)(qemu_regs_t *regs, int direction);
+    void (*mem)(uint64_t addr, void *buf, size_t n, int direction);  // difftest_ref_memcpy
+    void (*raise_intr)(uint64_t cause);
+} ref_plugin_t;
+
+
+// the reference the difftest loop runs against, QEMU or a plugin
+typedef struct ref ref_t;
+
+// connect to the QEMU started on listen_fd and run it to entry
+ref_t *ref_open_qemu(int listen_fd, uint64_t entry);
+
+// reload the QEMU behind conn, started by qemu_start_pooled() on the DRAM
+// dram and initialized once with qemu_init(), with image and stop it at
+// entry with all GPRs zero.  The connection stays the caller's: ref_close()
+// leaves it open, with QEMU stopped and nothing in flight.
+ref_t *ref_open_pooled(qemu_conn_t *conn, int dram, const char *image, uint64_t entry);
+
+// load the plugin at so_path, panics if it doesn't implement the ABI
+ref_t *ref_open_plugin(const char *so_path, const char *image, uint64_t entry);
+
+// replay a golden trace (golden.h), without any reference running
+ref_t *ref_open_golden(golden_t *golden);
+
+// follow QEMU running freely with plugin/difftest_ring.c, starting at entry
+// with all GPRs zero.  The ring stays the caller's.
+ref_t *ref_open_ring(ring_t *ring, uint64_t entry);
+
+// record what QEMU or the plugin does from now on into a golden trace at
+// path, kept only by ref_save_record()
+void ref_record(ref_t *ref, const char *path);
+
+void ref_save_record(ref_t *ref);
+
+// the run left what a golden trace or the ring can follow: another
+// interrupt or MMIO value than recorded or than QEMU took by itself, or past
+// the trace's end.  Only QEMU over GDB can go on from there.
+bool ref_stale(ref_t *ref);
+
+void ref_close(ref_t *ref);
+
+void ref_getregs(ref_t *ref, qemu_regs_t *r);
+
+bool ref_setregs(ref_t *ref, qemu_regs_t *r);
+
+// only r->array[idx[0..n-1]] need to be valid afterwards
+void ref_getregs_subset(ref_t *ref, qemu_regs_t *r, const int *idx, int n);
+
+// execute the n instructions the DUT committed at pcs[0..n-1]
+bool ref_step_n(ref_t *ref, const uint64_t *pcs, int n);
+
+// execute count instructions, starting at pc first and ending with the
+// hits-th execution of pc stop
+bool ref_run_to(ref_t *ref, uint64_t first, uint64_t stop, uint32_t hits, uint64_t count);
+
+// the DUT took the timer interrupt, let the reference take it next
+void ref_enable_int(ref_t *ref);
+
+// read len bytes of the reference's memory at addr, false if it can't
+bool ref_read_mem(ref_t *ref, uint64_t addr, void *buf, size_t len);
+
+// transport statistics, QEMU only
+void ref_print_stats(ref_t *ref, uint64_t instructions);
+
+// packets sent to the reference so far, 0 for a plugin
+uint64_t ref_packets(ref_t *ref);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The retired-instruction ring between QEMU, running at full speed with the
+// TCG plugin in plugin/difftest_ring.c, and the harness.  It lives in POSIX
+// shared memory created by the harness.  One producer, one consumer: QEMU
+// only moves head, the harness only moves tail, and QEMU waits while the
+// ring is full, so it never runs more than RING_RECORDS records ahead.
+// Plain C, the plugin includes it as well.
+
+#define RING_MAGIC   0x5a4a5632524e4731UL  // "ZJV2RNG1"
+#define RING_RECORDS (1 << 16)             // a power of two
+
+// the record belongs to the instruction of the record before
+#define RING_MORE 1
+
+typedef struct {
+    uint64_t pc;            // after the retired instruction, 0 with RING_MORE
+    uint64_t value;         // written to reg
+    uint32_t reg;           // qemu_regs_t.array index, 0 = nothing written
+    uint32_t flags;
+} ring_rec_t;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t entry;         // records start with the first instruction there
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    ring_rec_t recs[RING_RECORDS] __attribute__((aligned(64)));
+} ring_t;
+
+// the harness' side
+
+// create the ring in shared memory, its name for the plugin goes into name
+ring_t *ring_create(char *name, size_t len, uint64_t entry);
+
+void ring_destroy(ring_t *ring, const char *name);
+
+// the oldest record, NULL if QEMU published none within timeout_ms (0:
+// don't wait)
+const ring_rec_t *ring_peek(ring_t *ring, int timeout_ms);
+
+// done with the record of ring_peek(), QEMU may overwrite it
+void ring_pop(ring_t *ring);
+
+#endif
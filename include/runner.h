@@ -0,0 +1,12 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+// `emulator --run [options] ELF...`: run many difftests in parallel, each
+// in a private working directory, and write one summary for all of them
+int runner_main(int argc, char *argv[]);
+
+// write testfile.hex for elf into the working directory, the DUT's memory
+// image, straight from the ELF
+void runner_prepare_hex(const char *elf);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "VTileForVerilator.h"
+#include "verilated.h"
+
+// a phase of the program, the commits with lo <= pc < hi
+typedef struct {
+    std::string name;
+    uint64_t lo, hi;
+} sampler_phase_t;
+
+// the counters as of a commit, a row of samples.csv without its phase
+typedef struct {
+    uint64_t cycle, instructions;
+    uint64_t counter, common, dstall, istall, mdu_stall;
+} sampler_row_t;
+
+// records the DUT's performance counters as a time series into samples.csv,
+// one row every `every` cycles or instructions and one at every phase change.
+// A row is tagged with the phase the commits since the row before ran in.
+class Sampler {
+public:
+    ~Sampler();
+
+    // after every commit group, pc is the last one committed and
+    // instructions counts the group
+    inline void commit(uint64_t instructions, uint64_t pc) {
+        if (pc < phase_lo || pc >= phase_hi) {
+            enter_phase(pc);
+        }
+        sampler_row_t now = {(uint64_t) context->time() / 2, instructions,
+                             (uint64_t) dut->io_difftest_counter, (uint64_t) dut->io_difftest_common,
+                             (uint64_t) dut->io_difftest_dstall, (uint64_t) dut->io_difftest_istall,
+                             (uint64_t) dut->io_difftest_mduStall};
+        uint64_t at = by_inst ? instructions : now.cycle;
+        if (at >= next) {
+            record(now);
+            next = at - at % every + every;
+        }
+        last = now;
+    }
+
+private:
+    friend Sampler *sampler_open(VTileForVerilator *dut, VerilatedContext *context,
+                                 const char *every, const char *phases);
+
+    VTileForVerilator *dut;
+    VerilatedContext *context;
+    FILE *fp;
+    bool by_inst;
+    uint64_t every, next;
+    // as of the commit before, which closes a phase, and the last row written
+    sampler_row_t last = {};
+    uint64_t recorded = 0;
+
+    std::vector<sampler_phase_t> phases;    // sorted by lo
+    const char *phase = "-";
+    uint64_t phase_lo = 0, phase_hi = UINT64_MAX;
+
+    void enter_phase(uint64_t pc);
+    void record(const sampler_row_t &row);
+};
+
+// every is "cycle:N" or "inst:N", phases a comma separated list of
+// NAME=LO-HI pc ranges or NULL
+Sampler *sampler_open(VTileForVerilator *dut, VerilatedContext *context,
+                      const char *every, const char *phases);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef WAVE_H
+#define WAVE_H
+
+#include <stdint.h>
+
+#include "VTileForVerilator.h"
+#include "verilated.h"
+
+// a waveform backend behind the DUT, built for VCD or, with WAVE_FST (make
+// WAVE_FORMAT=fst), for FST compressed on Verilator's trace thread
+class Wave {
+public:
+    virtual ~Wave() {}
+
+    // after every half cycle
+    virtual void dump(uint64_t time) = 0;
+
+    // a commit group of n instructions at pcs retired, `instructions` in total
+    virtual void commit(uint64_t instructions, const uint64_t *pcs, int n) {}
+
+    // write out what is only kept in memory
+    virtual void flush(const char *reason) {}
+};
+
+// trace into sim.vcd/sim.fst once `trigger` fires: "cycle:N", "inst:N" or
+// "pc:ADDR", optionally followed by "+CYCLES" to stop again after that long
+Wave *wave_open_trigger(VTileForVerilator *dut, const char *trigger);
+
+// keep the last `cycles` to 2 * `cycles` cycles in memory and write them to
+// sim-window.vcd on flush(), VCD builds only
+Wave *wave_open_window(VTileForVerilator *dut, uint64_t cycles);
+
+static inline void wave_flush(Wave *wave, const char *reason) {
+    if (wave) {
+        wave->flush(reason);
+    }
+}
+
+#endif
@@ -1,31 +1,16 @@
 #!/bin/bash
 
-CYAN='\033[0;36m'
-NC='\033[0m' # No Color
-
 main() {
-    # difftest return code
-    dt_ret_code=0
-    
-    make -j
-
-    for FILE in cases/riscv-tests/*; do
-        elf=${FILE:6}
+    make -j || return 1
 
-        echo -e "Start testing on ${CYAN}${elf}${NC} !!!"
+    # every case runs in its own directory under build/run, see
+    # `./emulator --run --help` for the budgets and the summary
+    pushd build
+    ./emulator --run -j "$(nproc)" "$@" ../cases/riscv-tests/*
+    dt_ret_code=$?
+    popd
 
-        make prepare ELF=/$elf
-        pushd build
-        ./emulator
-        
-        ret_code=$?
-        if [ $ret_code != 0 ]; then
-            dt_ret_code=1
-        fi    
-        
-        popd
-    done 
     return $dt_ret_code
 }
 
-main
+main "$@"
@@ -0,0 +1,296 @@
+// QEMU TCG plugin: publishes every retired instruction of hart 0 into the
+// shared-memory ring of include/ring.h, so that QEMU can run at full speed,
+// block chaining and all, instead of being single-stepped over GDB.
+//
+//   qemu-system-riscv64 -plugin libdifftest-ring.so,shm=NAME,entry=ADDR ...
+//
+// The exec callback of an instruction runs before it executes, so it
+// completes the record of the instruction before: the pc it went on to, the
+// register it wrote, and the trap CSRs when it was a system instruction or
+// didn't fall through without being a jump (it trapped).  QEMU waits in the
+// callback while the ring is full.
+
+#include <fcntl.h>
+#include <glib.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <qemu-plugin.h>
+
+#include "ring.h"
+
+#if QEMU_PLUGIN_VERSION < 3
+#error "needs the register API of QEMU 9.1 or newer"
+#endif
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+// indexed like qemu_regs_t.array, see regs_alias in src/isa.c
+#define REGS_COUNT 83
+#define REG_PC     32
+#define REG_FPR    33
+#define REG_CSR    65
+
+static const char *reg_names[REGS_COUNT] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+    "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6", "pc",
+    "ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "ft6", "ft7",
+    "fs0", "fs1", "fa0", "fa1", "fa2", "fa3", "fa4", "fa5",
+    "fa6", "fa7", "fs2", "fs3", "fs4", "fs5", "fs6", "fs7",
+    "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11",
+    "mstatus", "medeleg", "mideleg", "mie",
+    "mip", "mtvec", "mscratch", "mepc",
+    "mcause", "mtval", "sstatus", "sie", "stvec",
+    "sscratch", "sepc", "scause", "stval", "sip",
+};
+
+typedef struct {
+    uint64_t pc;
+    uint32_t word;
+    uint8_t len;
+    uint8_t rd;         // qemu_regs_t.array index, 0 = none (x0 included)
+    bool jump;          // may not fall through
+    bool system;        // may write CSRs
+} insn_info_t;
+
+static ring_t *ring;
+static uint64_t entry;
+static bool started;
+static uint64_t head;
+
+static struct qemu_plugin_register *handles[REGS_COUNT];
+static GByteArray *reg_buf;
+// the CSRs as last published
+static uint64_t csrs[REGS_COUNT];
+
+// pc -> insn_info_t, shared by every TB the instruction is translated into
+static GHashTable *insns;
+static GMutex insns_lock;
+// the instruction whose record the next callback completes
+static const insn_info_t *pending;
+
+static uint64_t read_reg(int idx) {
+    uint64_t value = 0;
+    if (handles[idx] == NULL) {
+        return 0;
+    }
+    g_byte_array_set_size(reg_buf, 0);
+    int n = qemu_plugin_read_register(handles[idx], reg_buf);
+    if (n > 0) {
+        memcpy(&value, reg_buf->data, n < 8 ? n : 8);
+    }
+    return value;
+}
+
+// room for n more records
+static void ring_reserve(uint64_t n) {
+    while (head + n - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > RING_RECORDS) {
+        sched_yield();
+    }
+}
+
+static void ring_put(uint64_t pc, int reg, uint64_t value, uint32_t flags) {
+    ring_rec_t *rec = &ring->recs[head++ % RING_RECORDS];
+    rec->pc = pc;
+    rec->reg = reg;
+    rec->value = value;
+    rec->flags = flags;
+}
+
+static void insn_exec(unsigned int vcpu_index, void *udata) {
+    const insn_info_t *insn = (const insn_info_t *) udata;
+    if (vcpu_index != 0) {
+        return;
+    }
+    if (!started) {
+        if (insn->pc != entry) {
+            return;
+        }
+        // the harness starts from zeroed GPRs, only CSR changes are sent
+        for (int i = REG_CSR; i < REGS_COUNT; i++) {
+            csrs[i] = read_reg(i);
+        }
+        started = true;
+        pending = insn;
+        return;
+    }
+
+    const insn_info_t *prev = pending;
+    bool trapped = !prev->jump && insn->pc != prev->pc + prev->len;
+    ring_reserve(1 + REGS_COUNT - REG_CSR);
+    ring_put(insn->pc, prev->rd, prev->rd ? read_reg(prev->rd) : 0, 0);
+    if (prev->system || trapped) {
+        for (int i = REG_CSR; i < REGS_COUNT; i++) {
+            uint64_t value = read_reg(i);
+            if (value != csrs[i]) {
+                csrs[i] = value;
+                ring_put(0, i, value, RING_MORE);
+            }
+        }
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    pending = insn;
+}
+
+// the destination of the compressed instruction w, or none
+static void decode_rvc(uint16_t w, insn_info_t *info) {
+    int op = w & 3, funct3 = w >> 13;
+    int rd = (w >> 7) & 31, rd_c = ((w >> 2) & 7) + 8, rs1_c = ((w >> 7) & 7) + 8;
+    int rs2 = (w >> 2) & 31;
+    bool bit12 = (w >> 12) & 1;
+
+    if (op == 0) {
+        switch (funct3) {
+            case 0: case 2: case 3: info->rd = rd_c; break;         // c.addi4spn, c.lw, c.ld
+            case 1: info->rd = REG_FPR + rd_c; break;                // c.fld
+        }
+    } else if (op == 1) {
+        switch (funct3) {
+            case 0: case 1: case 2: case 3: info->rd = rd; break;   // c.addi(w), c.li, c.lui
+            case 4: info->rd = rs1_c; break;                         // c.srli ... c.and
+            default: info->jump = true; break;                       // c.j, c.beqz, c.bnez
+        }
+    } else if (op == 2) {
+        switch (funct3) {
+            case 0: case 2: case 3: info->rd = rd; break;           // c.slli, c.lwsp, c.ldsp
+            case 1: info->rd = REG_FPR + rd; break;                  // c.fldsp
+            case 4:
+                if (rs2 != 0) {
+                    info->rd = rd;                                   // c.mv, c.add
+                } else if (rd != 0) {
+                    info->jump = true;                               // c.jr, c.jalr
+                    info->rd = bit12 ? 1 : 0;
+                } else {
+                    info->system = true;                             // c.ebreak
+                }
+                break;
+        }
+    }
+}
+
+static void decode(uint32_t w, insn_info_t *info) {
+    int rd = (w >> 7) & 31, funct3 = (w >> 12) & 7, funct5 = w >> 27;
+
+    switch (w & 0x7f) {
+        case 0x37: case 0x17: case 0x03: case 0x13: case 0x1b:      // lui, auipc, loads, op-imm
+        case 0x33: case 0x3b: case 0x2f:                             // op, amo
+            info->rd = rd;
+            break;
+        case 0x6f: case 0x67:                                        // jal, jalr
+            info->rd = rd;
+            info->jump = true;
+            break;
+        case 0x63:                                                   // branches
+            info->jump = true;
+            break;
+        case 0x07: case 0x43: case 0x47: case 0x4b: case 0x4f:      // fp loads, fused
+            info->rd = REG_FPR + rd;
+            break;
+        case 0x53:
+            // compares, conversions to integers, fmv.x and fclass write GPRs
+            info->rd = funct5 == 0x14 || funct5 == 0x18 || funct5 == 0x1c ? rd : REG_FPR + rd;
+            break;
+        case 0x73:
+            info->rd = funct3 ? rd : 0;                              // csr*, or ecall, mret ...
+            info->system = true;
+            info->jump = funct3 == 0;
+            break;
+    }
+}
+
+static const insn_info_t *insn_info(struct qemu_plugin_insn *insn) {
+    uint64_t pc = qemu_plugin_insn_vaddr(insn);
+    uint32_t word = 0;
+    size_t len = qemu_plugin_insn_size(insn);
+    qemu_plugin_insn_data(insn, &word, len < sizeof(word) ? len : sizeof(word));
+
+    g_mutex_lock(&insns_lock);
+    insn_info_t *info = (insn_info_t *) g_hash_table_lookup(insns, &pc);
+    if (info == NULL || info->word != word) {
+        // not seen, or the code changed: the old entry may still be in use
+        // by a pending record, so it is leaked rather than freed
+        info = g_new0(insn_info_t, 1);
+        info->pc = pc;
+        info->word = word;
+        info->len = len;
+        if (len == 2) {
+            decode_rvc(word, info);
+        } else {
+            decode(word, info);
+        }
+        g_hash_table_insert(insns, &info->pc, info);
+    }
+    g_mutex_unlock(&insns_lock);
+    return info;
+}
+
+static void tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb) {
+    size_t n = qemu_plugin_tb_n_insns(tb);
+    for (size_t i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        qemu_plugin_register_vcpu_insn_exec_cb(insn, insn_exec, QEMU_PLUGIN_CB_R_REGS,
+                                               (void *) insn_info(insn));
+    }
+}
+
+static void vcpu_init(qemu_plugin_id_t id, unsigned int vcpu_index) {
+    if (vcpu_index != 0) {
+        return;
+    }
+    GArray *regs = qemu_plugin_get_registers();
+    for (guint i = 0; i < regs->len; i++) {
+        qemu_plugin_reg_descriptor *reg = &g_array_index(regs, qemu_plugin_reg_descriptor, i);
+        for (int idx = 1; idx < REGS_COUNT; idx++) {
+            if (strcmp(reg->name, reg_names[idx]) == 0) {
+                handles[idx] = reg->handle;
+            }
+        }
+    }
+    g_array_free(regs, TRUE);
+}
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
+                                           int argc, char **argv) {
+    const char *shm = NULL;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "shm=", 4) == 0) {
+            shm = argv[i] + 4;
+        } else if (strncmp(argv[i], "entry=", 6) == 0) {
+            entry = strtoull(argv[i] + 6, NULL, 0);
+        } else {
+            fprintf(stderr, "difftest-ring: unknown argument %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (shm == NULL) {
+        fprintf(stderr, "difftest-ring: needs shm=NAME\n");
+        return -1;
+    }
+
+    int fd = shm_open(shm, O_RDWR, 0);
+    if (fd < 0) {
+        fprintf(stderr, "difftest-ring: can't open shared memory %s\n", shm);
+        return -1;
+    }
+    ring = (ring_t *) mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED || __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC) {
+        fprintf(stderr, "difftest-ring: %s isn't a difftest ring\n", shm);
+        return -1;
+    }
+    if (entry == 0) {
+        entry = ring->entry;
+    }
+
+    reg_buf = g_byte_array_new();
+    insns = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
+    qemu_plugin_register_vcpu_tb_trans_cb(id, tb_trans);
+    return 0;
+}
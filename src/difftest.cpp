@@ -1,22 +1,116 @@
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
 
+#include <thread>
+#include <unordered_map>
+
 #include "verilated_vcd_c.h"
 
 #include "qemu.h"
+#include "ref.h"
+#include "ring.h"
 #include "dut.h"
 #include "isa.h"
+#include "difftest.h"
+#include "wave.h"
+#include "sampler.h"
+#include "prof.h"
+#include "commit_queue.h"
+#include "memcheck.h"
+
+uint64_t total_instructions;
+uint64_t difftest_max_cycles = 0;
+uint64_t difftest_full_interval = 0;
+uint64_t difftest_lockstep_interval = 0;
+uint64_t difftest_wave_window = 0;
+const char *difftest_wave_trigger = NULL;
+const char *difftest_sample_every = NULL;
+const char *difftest_sample_phases = NULL;
+bool difftest_gdb_tcp = false;
+bool difftest_no_diff = false;
+bool difftest_commit_trace = false;
+bool difftest_ipc_stats = false;
+bool difftest_gdb_stats = false;
+uint64_t difftest_pipeline_depth = 0;
+uint64_t difftest_mem_interval = 0;
+// nothing asked of difftest_qemu yet
+difftest_stats_t difftest_stats = {0, 0, 0, true};
+struct gdb_conn *difftest_qemu = NULL;
+int difftest_qemu_dram = -1;
+const char *difftest_golden_dir = NULL;
+
+// the DUT's waveform, NULL when it isn't traced
+static Wave *dut_wave;
+// the counter time series, NULL when it isn't sampled
+static Sampler *dut_sampler;
+const char *difftest_ref_plugin = NULL;
+const char *difftest_ring_plugin = NULL;
+
+// --ring: the ring QEMU streams into during this run, NULL over GDB
+static ring_t *qemu_ring;
+static char qemu_ring_name[64];
+// the DRAM of the QEMU difftest_start_pooled() starts
+static char qemu_dram_name[64];
+// the ring run was stale or didn't pass, run again over GDB
+static bool ring_failed;
+static bool ring_off;
+
+// --golden: the trace of this ELF, replayed when it could be opened and
+// recorded otherwise
+static char *golden_file;
+static golden_t *golden_replay;
+// the run went where the trace doesn't apply
+static bool golden_stale;
+
+// --mem-check: the stores of this run are tracked, last compared at
+// mem_checked_at instructions.  mem_final forces the comparison at the end.
+static bool mem_checking;
+static uint64_t mem_checked_at;
+static bool mem_final;
+
+// commit groups since the last full comparison
+static uint64_t unchecked_groups;
+
+// coarse lockstep: pcs committed in the open interval and how often, QEMU
+// catches up by running to the last one at the end of the interval
+static std::unordered_map<uint64_t, uint32_t> interval_hits;
+static uint64_t interval_first_pc, interval_last_pc, interval_count;
+// total_instructions at the last boundary where both sides matched
+static uint64_t interval_start;
+// the second run after a divergence: coarse up to replay_from, then
+// compare after every commit group
+static bool replaying;
+static uint64_t replay_from;
 
-int total_instructions;
+// an interval should end where QEMU needs at most this many breakpoint hits
+// to get to, but will end anyway at this many times its length
+#define LOCKSTEP_MAX_HITS    4
+#define LOCKSTEP_MAX_STRETCH 4
+
+// result of difftest_body() when a coarse interval didn't match
+#define DIFFTEST_DIVERGED    3
+
+// features a specialisation of difftest_loop() is built with, what isn't
+// in its set compiles out of the per-cycle path
+enum {
+    LOOP_WAVE   = 1 << 0,   // dut_wave is open
+    LOOP_SAMPLE = 1 << 1,   // dut_sampler is open
+    LOOP_COARSE = 1 << 2,   // difftest_lockstep_interval
+    LOOP_LAZY   = 1 << 3,   // difftest_full_interval
+    LOOP_TRACE  = 1 << 4,   // difftest_commit_trace
+    LOOP_ALL    = (1 << 5) - 1,
+    LOOP_DUT    = LOOP_WAVE | LOOP_SAMPLE,  // what --no-diff runs with
+};
 
-// #define WAVE_TRACE
-// #define IPC_TRACE
-// #define NO_DIFF
 #define MIE_MTIE (1 << 7)
 #define MIP_MTIP (1 << 7)
+#define MCAUSE_INDEX 73
+#define SCAUSE_INDEX 80
 
 // dump qemu registers
 void print_qemu_registers(qemu_regs_t *regs, bool wpc) {
@@ -66,7 +160,7 @@ void print_qemu_registers(qemu_regs_t *regs, bool wpc) {
 }
 
 
-void difftest_start_qemu(const char *path, int port, int ppid) {
+void difftest_start_qemu(const char *path, int servfd, int ppid) {
     // install a parent death signal in the child
     int r = prctl(PR_SET_PDEATHSIG, SIGTERM);
     if (r == -1) { panic("prctl error"); }
@@ -75,7 +169,40 @@ void difftest_start_qemu(const char *path, int port, int ppid) {
 
     close(0); // close STDIN
 
-    qemu_start(path, port);    // start qemu in single-step mode and stub gdb
+    if (qemu_ring) {
+        qemu_start_ring(path, difftest_ring_plugin, qemu_ring_name, qemu_ring->entry);
+    }
+    if (path == NULL) {
+        qemu_start_pooled(qemu_dram_name, servfd);
+    }
+    qemu_start_fd(path, servfd);    // start qemu in single-step mode and stub gdb
+    panic("failed to start qemu");
+}
+
+struct gdb_conn *difftest_start_pooled(const char *log, int *pid, int *dram) {
+    *dram = qemu_dram_create(qemu_dram_name, sizeof(qemu_dram_name));
+    if (*dram < 0) {
+        panic("can't create shared memory %s", qemu_dram_name);
+    }
+    int servfd = difftest_gdb_tcp ? get_free_servfd() : get_free_unix_servfd();
+    int ppid = getpid();
+    *pid = fork();
+    if (*pid < 0) {
+        panic("fork");
+    }
+    if (*pid == 0) {
+        if (freopen(log, "w", stdout) == NULL || dup2(fileno(stdout), 2) < 0) {
+            panic("can't redirect the output of QEMU to %s", log);
+        }
+        difftest_start_qemu(NULL, servfd, ppid);
+    }
+
+    // the target description is read once here, every run inherits it
+    qemu_conn_t *conn = qemu_connect_fd(servfd);
+    qemu_init(conn);
+    // QEMU has mapped its DRAM by now, the name can go
+    shm_unlink(qemu_dram_name);
+    return conn;
 }
 
 
@@ -93,25 +220,6 @@ void difftest_start_qemu(const char *path, int port, int ppid) {
 
 // 比较寄存器，包括 GPRs 和 CSRs
 bool difftest_regs (qemu_regs_t *regs, qemu_regs_t *dut_regs, diff_pcs *dut_pcs) {
-    const char *alias[regs_count] = {
-        "zero", "ra", "sp", "gp",
-        "tp", "t0", "t1", "t2",
-        "fp", "s1", "a0", "a1",
-        "a2", "a3", "a4", "a5",
-        "a6", "a7", "s2", "s3",
-        "s4", "s5", "s6", "s7",
-        "s8", "s9", "s10", "s11",
-        "t3", "t4", "t5", "t6", "pc",
-        "ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "ft6", "ft7",
-        "fs0", "fs1", "fa0", "fa1", "fa2", "fa3", "fa4", "fa5",
-        "fa6", "fa7", "fs2", "fs3", "fs4", "fs5", "fs6", "fs7",
-        "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11",
-        "mstatus", "medeleg", "mideleg", "mie", 
-        "mip", "mtvec", "mscratch", "mepc", 
-        "mcause", "mtval", "sstatus", "sie", "stvec", 
-        "sscratch", "sepc", "scause", "stval", "sip"
-    };
-
     static uint64_t last_3_qpcs[3] = {0};
     for (int i = 0; i < 32; i++) {
         // GPR
@@ -121,7 +229,7 @@ bool difftest_regs (qemu_regs_t *regs, qemu_regs_t *dut_regs, diff_pcs *dut_pcs)
                 printf("QEMU PC at [0x%016lx]\n", last_3_qpcs[j]);
             }
             printf("\x1B[31mError in $%s, QEMU %lx, ZJV2 %lx\x1B[37m\n", 
-                alias[i], regs->gpr[i], dut_regs->gpr[i]);
+                regs_alias[i], regs->gpr[i], dut_regs->gpr[i]);
             return false;
         }
         // FPR
@@ -131,7 +239,7 @@ bool difftest_regs (qemu_regs_t *regs, qemu_regs_t *dut_regs, diff_pcs *dut_pcs)
                 printf("QEMU PC at [0x%016lx]\n", last_3_qpcs[j]);
             }
             printf("\x1B[31mError in $%s, QEMU %lx, ZJV2 %lx\x1B[37m\n", 
-                alias[33 + i], regs->fpr[i + 33], dut_regs->fpr[i + 33]);
+                regs_alias[33 + i], regs->fpr[i + 33], dut_regs->fpr[i + 33]);
             return false;
         }
     }
@@ -151,7 +259,7 @@ bool difftest_regs (qemu_regs_t *regs, qemu_regs_t *dut_regs, diff_pcs *dut_pcs)
                 printf("QEMU PC at [0x%016lx]\n", last_3_qpcs[j]);
             }
             printf("\x1B[31mError in $%s, QEMU %lx, ZJV2 %lx\x1B[37m\n", 
-                alias[i], regs->array[i], dut_regs->array[i]);
+                regs_alias[i], regs->array[i], dut_regs->array[i]);
             return false;
         }
     }
@@ -162,6 +270,122 @@ bool difftest_regs (qemu_regs_t *regs, qemu_regs_t *dut_regs, diff_pcs *dut_pcs)
     return true;
 }
 
+// compare what the DUT stored since the last time, every
+// difftest_mem_interval instructions or when forced
+static bool difftest_check_memory(ref_t *ref, bool force) {
+    if (!mem_checking || (!force && total_instructions - mem_checked_at < difftest_mem_interval)) {
+        return true;
+    }
+    mem_checked_at = total_instructions;
+    uint64_t t = PROF_BEGIN();
+    bool ok = memcheck_compare(ref);
+    PROF_END(PROF_COMPARE, t);
+    if (!ok) {
+        printf("Memory differs after %lu instructions\n", total_instructions);
+    }
+    return ok;
+}
+
+// compare the whole state with the DUT's as given, dump both sides on a
+// mismatch
+bool difftest_compare(ref_t *ref, qemu_regs_t *regs, qemu_regs_t *dut_regs, diff_pcs *dut_pcs) {
+    ref_getregs(ref, regs);
+    unchecked_groups = 0;
+
+    uint64_t t = PROF_BEGIN();
+    bool ok = difftest_regs(regs, dut_regs, dut_pcs);
+    PROF_END(PROF_COMPARE, t);
+    if (!ok) {
+        sleep(1);
+        // QEMU's own CLINT timer fired, ahead of the DUT's: not a DUT bug
+        // but the timer sync of qemu_enable_int() failing
+        if (regs->mcause == MIP_MTIP_CAUSE &&
+            (dut_regs->mcause != regs->mcause || dut_regs->mepc != regs->mepc)) {
+            printf("QEMU took a timer interrupt the DUT didn't take: the reference's timer fired "
+                   "on its own and the harness timer sync broke down.  QEMU's mtime ticks once "
+                   "per 100 instructions, the DUT's must tick at least as often.\n");
+        }
+        printf("\nQEMU\n");
+        // qemu_getmem(conn, 0x200bff8);
+        // qemu_getmem(conn, 0x2004000);
+        print_qemu_registers(regs, true);
+        printf("\nDUT\n");
+        for (int i = 0; i < 3; i++) {
+            printf("$pc_%d:0x%016lx  ", i, dut_pcs->mycpu_pcs[i]);
+        }
+        printf("\n");
+        print_qemu_registers(dut_regs, false);
+        printf("\n");
+        return false;
+    }
+    return difftest_check_memory(ref, mem_final);
+}
+
+// fetch and compare the whole state
+bool difftest_check_all(ref_t *ref, qemu_regs_t *regs, qemu_regs_t *dut_regs, diff_pcs *dut_pcs) {
+    dut_getregs(dut_regs);
+    dut_getpcs(dut_pcs);
+    return difftest_compare(ref, regs, dut_regs, dut_pcs);
+}
+
+// the per-group check between two full ones: only the register the DUT
+// wrote back (wdest 0: none) and the trap causes are fetched.  False if a
+// full comparison is due, because of a mismatch or a trap on either side.
+bool difftest_check_writes(ref_t *ref, qemu_regs_t *regs, int wdest, uint64_t wdata,
+                           uint64_t dut_mcause, uint64_t dut_scause) {
+    uint64_t mcause = regs->mcause, scause = regs->scause;
+    int idx[3] = {MCAUSE_INDEX, SCAUSE_INDEX};
+    int n = 2;
+    if (wdest != 0) {
+        idx[n++] = wdest;
+    }
+    ref_getregs_subset(ref, regs, idx, n);
+
+    if (regs->mcause != mcause || regs->scause != scause ||
+        regs->mcause != dut_mcause || regs->scause != dut_scause) {
+        return false;
+    }
+    return wdest == 0 || regs->gpr[wdest] == wdata;
+}
+
+bool lockstep_active(uint64_t committed) {
+    return difftest_lockstep_interval && !(replaying && committed >= replay_from);
+}
+
+// add a commit group to the open interval, true if the interval ends here
+bool lockstep_add(diff_pcs *dut_pcs, int n, bool event) {
+    if (n == 0) {
+        return event;
+    }
+    if (interval_hits.empty()) {
+        interval_first_pc = dut_pcs->mycpu_pcs[0];
+    }
+    for (int i = 0; i < n; i++) {
+        interval_hits[dut_pcs->mycpu_pcs[i]]++;
+    }
+    interval_last_pc = dut_pcs->mycpu_pcs[n - 1];
+    interval_count += n;
+
+    uint64_t len = total_instructions - interval_start;
+    if (event || (replaying && total_instructions >= replay_from)) {
+        return true;
+    }
+    return (len >= difftest_lockstep_interval && interval_hits[interval_last_pc] <= LOCKSTEP_MAX_HITS) ||
+           len >= LOCKSTEP_MAX_STRETCH * difftest_lockstep_interval;
+}
+
+// bring QEMU to the end of the open interval
+bool lockstep_catch_up(ref_t *ref) {
+    if (interval_hits.empty()) {
+        return true;
+    }
+    bool ok = ref_run_to(ref, interval_first_pc, interval_last_pc,
+                         interval_hits[interval_last_pc], interval_count);
+    interval_hits.clear();
+    interval_count = 0;
+    return ok;
+}
+
 char *get_wf_filename() {
     char *filename = new char[64];
     time_t now = time(0);
@@ -174,28 +398,71 @@ bool check_end_ysyx() {
     return dut->io_difftest_finish;
 }
 
-bool check_and_close_difftest(qemu_conn_t *conn, VerilatedVcdC* vfp, VerilatedContext* context) {
+void difftest_close_ref(ref_t *ref, int result) {
+    difftest_stats.ref_packets = ref_packets(ref);
+    if (result == 0) {
+        ref_save_record(ref);
+    }
+    if (qemu_ring) {
+        ring_failed |= ref_stale(ref);
+    } else {
+        golden_stale |= ref_stale(ref);
+    }
+    ref_close(ref);
+    difftest_stats.qemu_idle = true;
+}
+
+void print_ipc_stats() {
+    printf("Total Instructions: %lu\n", total_instructions);
+    printf("Total Cycles: %lld\n", dut->io_difftest_counter);
+    printf("IPC: %lf\n", double(total_instructions) / dut->io_difftest_counter);
+    printf("Both Cache Stall Cycles: %lld\n", dut->io_difftest_common);
+    printf("\tDcache Stall Cycles: %lld\n", dut->io_difftest_dstall);
+    printf("\tIcache Stall Cycles: %lld\n", dut->io_difftest_istall);
+    printf("MDU Stall Cycles: %lld\n", dut->io_difftest_mduStall);
+}
+
+bool check_and_close_difftest(ref_t *ref, int *result) {
     if (check_end_ysyx()) {
-        printf("difftest pass!\n");
+        *result = 0;
+        mem_final = true;
+        if (unchecked_groups || !interval_hits.empty()) {
+            // the lazy or the coarse mode still owes a full comparison, catch
+            // up with whatever the DUT committed in this last cycle first
+            qemu_regs_t regs = {0}, dut_regs = {0};
+            diff_pcs dut_pcs = {0};
+            dut_getpcs(&dut_pcs);
+            bool coarse = !interval_hits.empty();
+            bool ok;
+            if (coarse) {
+                if (dut_commit()) {
+                    lockstep_add(&dut_pcs, dut_commit(), true);
+                }
+                ok = lockstep_catch_up(ref);
+            } else {
+                ok = ref_step_n(ref, dut_pcs.mycpu_pcs, dut_commit());
+            }
+            if (!ok || !difftest_check_all(ref, &regs, &dut_regs, &dut_pcs)) {
+                *result = coarse ? DIFFTEST_DIVERGED : 1;
+            }
+        } else if (!dut_commit() && !difftest_check_memory(ref, true)) {
+            // the reference is level with the DUT unless this cycle committed
+            *result = 1;
+        }
+        if (*result == 0) {
+            printf("difftest pass!\n");
+        } else if (*result == 1) {
+            wave_flush(dut_wave, "difftest failed");
+        }
+
+        if (difftest_ipc_stats) {
+            print_ipc_stats();
+        }
+        if (difftest_gdb_stats) {
+            ref_print_stats(ref, total_instructions);
+        }
 
-#ifdef IPC_TRACE
-        // print information
-        printf("Total Instructions: %d\n", total_instructions);
-        printf("Total Cycles: %lld\n", dut->io_difftest_counter);
-        printf("IPC: %lf\n", double(total_instructions) / dut->io_difftest_counter);
-        printf("Both Cache Stall Cycles: %lld\n", dut->io_difftest_common);
-        printf("\tDcache Stall Cycles: %lld\n", dut->io_difftest_dstall);
-        printf("\tIcache Stall Cycles: %lld\n", dut->io_difftest_istall);
-        printf("MDU Stall Cycles: %lld\n", dut->io_difftest_mduStall);
-#endif
-
-#ifdef WAVE_TRACE
-        dut_step(100, vfp, context);
-        vfp->close();
-        delete vfp;
-        delete context;
-#endif
-        qemu_disconnect(conn);
+        difftest_close_ref(ref, *result);
         return true;
     }
     return false;
@@ -211,46 +478,460 @@ bool ysyx_skip_print(qemu_conn_t *conn, uint32_t pc) {
     return qemu_setinst(conn, pc, &nop);
 }
 
-bool is_stop = false;
+volatile sig_atomic_t is_stop = false;
 void stop(int signo) {
     printf("receive CTRL C INT!\n");
     is_stop = true;
 }
 
-int difftest_body(const char *path, int port) {
+// SIGUSR1: write out the wave window and carry on
+volatile sig_atomic_t wave_requested = false;
+void request_wave(int signo) {
+    wave_requested = true;
+}
+
+// SIGUSR2: print the --profile breakdown so far
+volatile sig_atomic_t prof_requested = false;
+void request_profile(int signo) {
+    prof_requested = true;
+}
+
+// commit groups dut_run() may capture before the DUT's state has to be
+// looked at again: up to the next full comparison of the lazy mode, or up
+// to where the open interval can end at the earliest (3 instructions a
+// group).  Waves, samples and traces want every group as it happens.
+template <unsigned F>
+static int difftest_batch() {
+    if ((F & (LOOP_WAVE | LOOP_SAMPLE | LOOP_TRACE)) || replaying) {
+        return 1;
+    }
+    uint64_t n = 1;
+    if (F & LOOP_COARSE) {
+        uint64_t len = total_instructions - interval_start;
+        n = len < difftest_lockstep_interval ? (difftest_lockstep_interval - len) / 3 : 1;
+    } else if (F & LOOP_LAZY) {
+        n = difftest_full_interval - unchecked_groups;
+    }
+    return n < 1 ? 1 : n > DUT_RUN_MAX ? DUT_RUN_MAX : n;
+}
+
+// step the reference over a commit group and check it.  last: the DUT is
+// still right after the group, so its full state can be compared.  False,
+// with *result set, when the run has to stop.
+template <unsigned F>
+static bool difftest_group(ref_t *ref, const dut_group_t *g, bool last, qemu_regs_t *regs,
+                           qemu_regs_t *dut_regs, diff_pcs *dut_pcs, int *result) {
+    bool coarse = (F & LOOP_COARSE) && lockstep_active(total_instructions);
+    total_instructions += g->n;
+    *dut_pcs = g->pcs;
+    if (F & LOOP_WAVE) {
+        dut_wave->commit(total_instructions, g->pcs.mycpu_pcs, g->n);
+    }
+    if ((F & LOOP_SAMPLE) && g->n) {
+        dut_sampler->commit(total_instructions, g->pcs.mycpu_pcs[g->n - 1]);
+    }
+    if (coarse) {
+        // QEMU only catches up at the end of the interval, and MMIO syncs
+        // and interrupts have to happen in step with the DUT
+        if (!lockstep_add(dut_pcs, g->n, g->mmio || g->intr)) {
+            return true;
+        }
+        if (!lockstep_catch_up(ref)) {
+            *result = DIFFTEST_DIVERGED;
+            return false;
+        }
+    } else if (!(F & LOOP_TRACE)) {
+        // advance QEMU over the whole commit group at once
+        if (!ref_step_n(ref, g->pcs.mycpu_pcs, g->n)) {
+            *result = 1;
+            return false;
+        }
+    } else {
+        printf("DUT commits %d instructions\n", g->n);
+        dut_getregs(dut_regs);
+        for (int i = 0; i < g->n; i++) {
+            ref_step_n(ref, &g->pcs.mycpu_pcs[i], 1);
+
+            ref_getregs(ref, regs);
+            printf("\nQEMU\n");
+            print_qemu_registers(regs, true);
+            printf("\nDUT\n");
+            for (int i = 0; i < 3; i++) {
+                printf("$pc_%d:0x%016lx  ", i, g->pcs.mycpu_pcs[i]);
+            }
+            printf("\n");
+            print_qemu_registers(dut_regs, false);
+            printf("==============\n");
+        }
+    }
+    if (g->mmio) { // sync mmio data
+        ref_getregs(ref, regs);
+        regs->gpr[g->wdest] = g->wdata;
+        ref_setregs(ref, regs);
+    }
+    if (g->intr) {
+        ref_enable_int(ref);
+    }
+
+    // lazy mode: a full comparison every difftest_full_interval groups,
+    // on MMIO syncs and interrupts, otherwise only the written register
+    bool full = !(F & LOOP_LAZY) || coarse || replaying || g->mmio ||
+                g->intr || ++unchecked_groups >= difftest_full_interval;
+    if (!full) {
+        if (difftest_check_writes(ref, regs, g->wdest, g->wdata, g->mcause, g->scause)) {
+            return true;
+        }
+        if (!last) {
+            // dut_run() stops at the DUT's traps, so this is a mismatch and
+            // the DUT's state of the group is gone
+            printf("\x1B[31mError in the group at pc 0x%016lx: QEMU $%s %lx mcause %lx scause %lx, "
+                   "ZJV2 %lx mcause %lx scause %lx\x1B[37m\n", g->pcs.mycpu_pcs[0],
+                   regs_alias[g->wdest], regs->gpr[g->wdest], regs->mcause, regs->scause,
+                   g->wdata, g->mcause, g->scause);
+            *result = 1;
+            return false;
+        }
+    }
+    assert(last);   // difftest_batch() ends the batch where a full comparison is due
+
+    if (!difftest_check_all(ref, regs, dut_regs, dut_pcs)) {
+        *result = coarse ? DIFFTEST_DIVERGED : 1;
+        return false;
+    }
+    if (coarse) {
+        interval_start = total_instructions;
+    }
+    return true;
+}
+
+// the main loop, one copy per feature set F
+template <unsigned F>
+static int difftest_loop(ref_t *ref, VerilatedContext *contextp) {
+    constexpr bool WAVE = F & LOOP_WAVE;
     int result = 0;
-    Verilated::traceEverOn(true);
-    VerilatedVcdC* vfp;
-    VerilatedContext* contextp;
-    dut = new VTileForVerilator;
-    vfp = new VerilatedVcdC;
-    contextp = new VerilatedContext;
-#ifdef WAVE_TRACE
-    dut->trace(vfp, 99);
-    vfp->open("sim.vcd");
-    // dut->dump(0);
-#endif
     qemu_regs_t regs = {0};
     qemu_regs_t dut_regs = {0};
-
     diff_pcs dut_pcs = {0};
-    diff_mmios dut_mmios = {0};
-    int bubble_count = 0;
 
-    qemu_conn_t *conn = qemu_connect(port);
-    qemu_init(conn);                            // 初始化 GDB，发送 qXfer 命令注册 features 
+    ref_getregs(ref, &regs);
 
-    extern uint64_t elf_entry;
-    regs.pc = elf_entry;
-    qemu_break(conn, elf_entry);
-    qemu_continue(conn);
-    qemu_remove_breakpoint(conn, elf_entry);
-    qemu_setregs(conn, &regs);
-    qemu_getregs(conn, &regs);
+    while (1) {
+        if (wave_requested) {
+            wave_requested = false;
+            wave_flush(dut_wave, "SIGUSR1");
+        }
+        if (UNLIKELY(prof_requested)) {
+            prof_requested = false;
+            prof_report(total_instructions, contextp->time() / 2);
+        }
+        if (is_stop) {
+            wave_flush(dut_wave, "interrupted");
+            result = 1;
+            break;
+        }
+
+        int groups;
+        int why = dut_run<WAVE>(difftest_batch<F>(), difftest_max_cycles, &groups, dut_wave, contextp);
+        if (why == DUT_RUN_BUBBLES) {
+            printf("Too many bubbles.\n");
+            wave_flush(dut_wave, "too many bubbles");
+        }
+        int g = 0;
+        while (g < groups && difftest_group<F>(ref, &dut_groups[g], g == groups - 1,
+                                               &regs, &dut_regs, &dut_pcs, &result)) {
+            g++;
+        }
+        if (g < groups) {
+            break;
+        }
+        if (why == DUT_RUN_FINISH) {
+            check_and_close_difftest(ref, &result);
+            return result;
+        }
+        if (why == DUT_RUN_CYCLES) {
+            printf("Cycle budget of %lu cycles exhausted.\n", difftest_max_cycles);
+            result = DIFFTEST_CYCLE_BUDGET;
+            break;
+        }
+    }
+    if (result == 1) {
+        wave_flush(dut_wave, "difftest failed");
+    }
+    difftest_close_ref(ref, result);
+
+    return result;
+}
+
+typedef int (*difftest_loop_t)(ref_t *ref, VerilatedContext *contextp);
+static const difftest_loop_t difftest_loops[LOOP_ALL + 1] = {
+    difftest_loop<0>,  difftest_loop<1>,  difftest_loop<2>,  difftest_loop<3>,
+    difftest_loop<4>,  difftest_loop<5>,  difftest_loop<6>,  difftest_loop<7>,
+    difftest_loop<8>,  difftest_loop<9>,  difftest_loop<10>, difftest_loop<11>,
+    difftest_loop<12>, difftest_loop<13>, difftest_loop<14>, difftest_loop<15>,
+    difftest_loop<16>, difftest_loop<17>, difftest_loop<18>, difftest_loop<19>,
+    difftest_loop<20>, difftest_loop<21>, difftest_loop<22>, difftest_loop<23>,
+    difftest_loop<24>, difftest_loop<25>, difftest_loop<26>, difftest_loop<27>,
+    difftest_loop<28>, difftest_loop<29>, difftest_loop<30>, difftest_loop<31>,
+};
+
+// --no-diff: the DUT on its own until it finishes
+template <unsigned F>
+static int difftest_dut_only(ref_t *ref, VerilatedContext *contextp) {
+    constexpr bool WAVE = F & LOOP_WAVE;
+    while (!dut->io_difftest_finish) {
+        if (UNLIKELY(prof_requested)) {
+            prof_requested = false;
+            prof_report(total_instructions, contextp->time() / 2);
+        }
+        if (is_stop) {
+            wave_flush(dut_wave, "interrupted");
+            return 1;
+        }
+        int groups;
+        int why = dut_run<WAVE>(F & LOOP_SAMPLE ? 1 : DUT_RUN_MAX, difftest_max_cycles,
+                                &groups, dut_wave, contextp);
+        for (int g = 0; g < groups; g++) {
+            int n = dut_groups[g].n;
+            total_instructions += n;
+            if ((F & LOOP_SAMPLE) && n) {
+                dut_sampler->commit(total_instructions, dut_groups[g].pcs.mycpu_pcs[n - 1]);
+            }
+        }
+        if (why == DUT_RUN_CYCLES) {
+            printf("Cycle budget of %lu cycles exhausted.\n", difftest_max_cycles);
+            return DIFFTEST_CYCLE_BUDGET;
+        }
+    }
+    printf("DUT finished after %lu instructions\n", total_instructions);
+    if (difftest_ipc_stats) {
+        print_ipc_stats();
+    }
+    return 0;
+}
+
+static const difftest_loop_t difftest_dut_loops[LOOP_DUT + 1] = {
+    difftest_dut_only<0>, difftest_dut_only<1>, difftest_dut_only<2>, difftest_dut_only<3>,
+};
+
+// --pipeline: a commit group as the DUT thread hands it to the checker
+typedef struct {
+    diff_pcs pcs;
+    qemu_regs_t regs;       // the DUT's state after the group
+    uint64_t wdata;
+    int n;                  // instructions committed
+    int wdest;              // register written back, 0 = none
+    bool mmio;
+    bool intr;
+    bool finish;            // the last record, the DUT finished
+} commit_rec_t;
+
+static void commit_capture(commit_rec_t *rec, bool finish) {
+    dut_getpcs(&rec->pcs);
+    dut_getregs(&rec->regs);
+    diff_mmios mmios;
+    dut_getmmios(&mmios);
+    rec->n = dut_commit();
+    rec->wdest = dut->io_difftest_we ? dut->io_difftest_wdest : 0;
+    rec->wdata = dut->io_difftest_wdata;
+    rec->mmio = (mmios.mycpu_mmios[0] || mmios.mycpu_mmios[1] || mmios.mycpu_mmios[2]) && dut->io_difftest_we;
+    rec->intr = dut->io_difftest_int;
+    rec->finish = finish;
+}
+
+// the checker thread: the reference side of difftest_loop() for the records
+// of the queue.  0 when the DUT finished in step, 1 on a mismatch, -1 when
+// the DUT stopped before it finished.
+static int difftest_checker(ref_t *ref, CommitQueue<commit_rec_t> *queue) {
+    qemu_regs_t regs = {0};
+    ref_getregs(ref, &regs);
+
+    commit_rec_t *rec;
+    for (; (rec = queue->front()) != NULL; queue->pop()) {
+        if (rec->finish) {
+            // the lazy mode still owes a full comparison
+            if (unchecked_groups && (!ref_step_n(ref, rec->pcs.mycpu_pcs, rec->n) ||
+                                     !difftest_compare(ref, &regs, &rec->regs, &rec->pcs))) {
+                return 1;
+            }
+            return 0;
+        }
+        if (!ref_step_n(ref, rec->pcs.mycpu_pcs, rec->n)) {
+            return 1;
+        }
+        if (rec->mmio) {
+            ref_getregs(ref, &regs);
+            regs.gpr[rec->wdest] = rec->wdata;
+            ref_setregs(ref, &regs);
+        }
+        if (rec->intr) {
+            ref_enable_int(ref);
+        }
+
+        bool full = !difftest_full_interval || rec->mmio || rec->intr ||
+                    ++unchecked_groups >= difftest_full_interval;
+        if (!full && difftest_check_writes(ref, &regs, rec->wdest, rec->wdata,
+                                           rec->regs.mcause, rec->regs.scause)) {
+            continue;
+        }
+        if (!difftest_compare(ref, &regs, &rec->regs, &rec->pcs)) {
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// the DUT thread of --pipeline: steps the model and queues its commit
+// groups for the checker, at most difftest_pipeline_depth groups ahead.  A
+// mismatch stops it within that many groups.
+template <unsigned F>
+static int difftest_pipelined(ref_t *ref, VerilatedContext *contextp) {
+    constexpr bool WAVE = F & LOOP_WAVE;
+    CommitQueue<commit_rec_t> queue(difftest_pipeline_depth);
+    int checked = -1;
+    std::thread checker([&] {
+        checked = difftest_checker(ref, &queue);
+        queue.close();
+    });
+
+    int result = 0;
+    commit_rec_t *rec;
+    while ((rec = queue.back()) != NULL) {
+        if (wave_requested) {
+            wave_requested = false;
+            wave_flush(dut_wave, "SIGUSR1");
+        }
+        if (UNLIKELY(prof_requested)) {
+            prof_requested = false;
+            prof_report(total_instructions, contextp->time() / 2);
+        }
+        if (is_stop) {
+            wave_flush(dut_wave, "interrupted");
+            result = 1;
+            break;
+        }
+        // one group at a time, the record holds the registers after it
+        int groups;
+        int why = dut_run<WAVE>(1, difftest_max_cycles, &groups, dut_wave, contextp);
+        if (why == DUT_RUN_CYCLES) {
+            printf("Cycle budget of %lu cycles exhausted.\n", difftest_max_cycles);
+            result = DIFFTEST_CYCLE_BUDGET;
+            break;
+        }
+        if (why == DUT_RUN_FINISH) {
+            commit_capture(rec, true);
+            queue.push();
+            break;
+        }
+        if (why == DUT_RUN_BUBBLES) {
+            printf("Too many bubbles.\n");
+            wave_flush(dut_wave, "too many bubbles");
+        }
+
+        total_instructions += dut_groups[0].n;
+        commit_capture(rec, false);
+        if (WAVE) {
+            dut_wave->commit(total_instructions, rec->pcs.mycpu_pcs, rec->n);
+        }
+        if ((F & LOOP_SAMPLE) && rec->n) {
+            dut_sampler->commit(total_instructions, rec->pcs.mycpu_pcs[rec->n - 1]);
+        }
+        queue.push();
+    }
+    queue.close();
+    checker.join();
+
+    // a mismatch the checker found in the groups still queued comes first
+    if (checked >= 0) {
+        result = checked;
+    }
+    if (result == 0) {
+        printf("difftest pass!\n");
+        if (difftest_ipc_stats) {
+            print_ipc_stats();
+        }
+        if (difftest_gdb_stats) {
+            ref_print_stats(ref, total_instructions);
+        }
+    } else if (result == 1) {
+        wave_flush(dut_wave, "difftest failed");
+    }
+    difftest_close_ref(ref, result);
+    return result;
+}
+
+static const difftest_loop_t difftest_pipelined_loops[LOOP_DUT + 1] = {
+    difftest_pipelined<0>, difftest_pipelined<1>, difftest_pipelined<2>, difftest_pipelined<3>,
+};
+
+int difftest_body(const char *path, int servfd) {
+    VerilatedContext* contextp;
+    // keep the model from tracking signal activity unless it is traced
+    Verilated::traceEverOn(difftest_wave_window || difftest_wave_trigger);
+    dut = new VTileForVerilator;
+    contextp = new VerilatedContext;
+    if (difftest_wave_window) {
+        dut_wave = wave_open_window(dut, difftest_wave_window);
+    } else if (difftest_wave_trigger) {
+        dut_wave = wave_open_trigger(dut, difftest_wave_trigger);
+    }
+    if (difftest_sample_every) {
+        dut_sampler = sampler_open(dut, contextp, difftest_sample_every, difftest_sample_phases);
+    }
+    unsigned features = (dut_wave ? LOOP_WAVE : 0) |
+                        (dut_sampler ? LOOP_SAMPLE : 0) |
+                        (difftest_lockstep_interval ? LOOP_COARSE : 0) |
+                        (difftest_full_interval ? LOOP_LAZY : 0) |
+                        (difftest_commit_trace ? LOOP_TRACE : 0);
 
     // set up device under test
-    dut_reset(10, vfp, contextp);
+    dut_reset(10, dut_wave, contextp);
     dut_sync_reg(0, 0, false);
+    signal(SIGINT, stop);
+    signal(SIGUSR1, request_wave);
+    signal(SIGUSR2, request_profile);
+
+    ref_t *ref = NULL;
+    difftest_loop_t loop = difftest_dut_loops[features & LOOP_DUT];
+    if (!difftest_no_diff) {
+        extern uint64_t elf_entry;
+        if (golden_replay) {
+            ref = ref_open_golden(golden_replay);
+            golden_replay = NULL;
+        } else if (qemu_ring) {
+            ref = ref_open_ring(qemu_ring, elf_entry);
+        } else {
+            if (difftest_ref_plugin) {
+                ref = ref_open_plugin(difftest_ref_plugin, path, elf_entry);
+            } else if (difftest_qemu) {
+                difftest_stats.qemu_idle = false;
+                ref = ref_open_pooled(difftest_qemu, difftest_qemu_dram, path, elf_entry);
+            } else {
+                ref = ref_open_qemu(servfd, elf_entry);
+            }
+            if (golden_file) {
+                // every instruction is recorded, coarse intervals have nothing to gain
+                ref_record(ref, golden_file);
+                features &= ~LOOP_COARSE;
+            }
+        }
+        loop = difftest_loops[features];
+        if (difftest_pipeline_depth) {
+            if (features & (LOOP_COARSE | LOOP_TRACE)) {
+                printf("--pipeline doesn't apply to --lockstep and --commit-trace, running in step\n");
+            } else {
+                loop = difftest_pipelined_loops[features & LOOP_DUT];
+            }
+        }
+        if (difftest_mem_interval) {
+            // the stores come from the DUT thread, ahead of the checker
+            if (difftest_pipeline_depth && !(features & (LOOP_COARSE | LOOP_TRACE))) {
+                printf("--mem-check doesn't apply to --pipeline, memory isn't compared\n");
+            } else {
+                memcheck_start();
+                mem_checking = true;
+            }
+        }
+    }
 
     // for(int i = 0; i < 100; i++) {
     //     dut_step(1, vfp, contextp);
@@ -281,8 +962,6 @@ int difftest_body(const char *path, int port) {
     // a = qemu_getinst(conn, 0x80005394);
     // printf("0x80005394: %08x\n", a.val);
 
-
-    signal(SIGINT, stop);
     // while(1) {
     //     if (!is_stop) {
     //         dut_sync_reg(0, 0, false);
@@ -293,115 +972,139 @@ int difftest_body(const char *path, int port) {
     //     }
     // }
 
-    while (1) {
-        dut_step(1, vfp, contextp);
-        if (check_and_close_difftest(conn, vfp, contextp))
-            return 0;
-        bubble_count = 0;
-        dut_sync_reg(0, 0, false);
+    // the profile starts with the first cycle, QEMU's startup isn't in it
+    if (prof_enabled) {
+        prof_start();
+    }
+    int result = loop(ref, contextp);
+    if (mem_checking) {
+        if (memcheck_stores() == 0) {
+            printf("--mem-check: the DUT reported no stores, does its RTL call difftest_store_commit()?\n");
+        }
+        memcheck_stop();
+        mem_checking = false;
+    }
+    difftest_stats.instructions = total_instructions;
+    difftest_stats.cycles = contextp->time() / 2;
+    if (prof_enabled) {
+        prof_report(total_instructions, contextp->time() / 2);
+    }
+    return result;
+}
 
-        while (dut_commit() == 0) {
-            dut_step(1, vfp, contextp);
-            if (check_and_close_difftest(conn, vfp, contextp))
-                return 0;
+// difftest_body() with a DUT of its own
+static int difftest_run(const char *path, int servfd) {
+    int result = difftest_body(path, servfd);
+    delete dut_wave;
+    dut_wave = NULL;
+    delete dut_sampler;
+    dut_sampler = NULL;
+    delete dut;
+    return result;
+}
 
-            bubble_count++;
-            // printf("dut bubble count: %d\n", bubble_count);
+int difftest_once(const char *path) {
+    if (difftest_golden_dir && !difftest_no_diff) {
+        free(golden_file);
+        golden_file = golden_path(difftest_golden_dir, path);
+        golden_replay = golden_open(golden_file);
+    }
 
-            if (bubble_count > 200) {
-                printf("Too many bubbles.\n");
-                break;
-            }
+    bool pooled = difftest_qemu && !(difftest_ring_plugin && !ring_off);
+    if (difftest_ref_plugin || difftest_no_diff || golden_replay || pooled) {
+        if (difftest_no_diff) {
+            printf("Running ZJV2 without a reference\n");
+        } else if (golden_replay) {
+            printf("Welcome to ZJV2 differential test with the golden trace %s!\n", golden_file);
+        } else if (pooled) {
+            printf("Welcome to ZJV2 differential test with QEMU, reloaded in place!\n");
+        } else {
+            printf("Welcome to ZJV2 differential test with %s!\n", difftest_ref_plugin);
         }
+        return difftest_run(path, -1);
+    }
 
-        total_instructions += dut_commit();
-        dut_getmmios(&dut_mmios);
-        for (int i = 0; i < dut_commit(); i++) {
-            // get current instruction
-            inst_t inst = qemu_getinst(conn, regs.pc);
-           
-            // if (inst_is_load_uart(inst, &regs)) {
-            //     printf("[DEBUG] is load uart | pc: %08x | inst: %08x\n", regs.pc, inst.val);
-            //     for (int i = 0; i < 32; ++i) {
-            //         dut_sync_reg(i, regs.gpr[i], true);
-            //     }
-            // }
-            // if (inst_is_print(inst)) {
-            //     ysyx_skip_print(conn, regs.pc);
-            // }
-            qemu_single_step(conn);
-            qemu_disable_int(conn);
-            sleep(0.25);
-
-#ifdef TRACE
-            qemu_getregs(conn, &regs);
-            printf("\nQEMU\n");
-            print_qemu_registers(&regs, true);
-            printf("\nDUT\n");
-            for (int i = 0; i < 3; i++) {
-                printf("$pc_%d:0x%016lx  ", i, dut_pcs.mycpu_pcs[i]);
-            }
-            printf("\n");
-            print_qemu_registers(&dut_regs, false);
-            printf("==============\n");
-#endif
-        }
-        dut_getpcs(&dut_pcs);
-        if ((dut_mmios.mycpu_mmios[0] || dut_mmios.mycpu_mmios[1] || dut_mmios.mycpu_mmios[2]) && dut->io_difftest_we) { // sync mmio data
-            // printf("mmio: %d, we: %d, wdata: %lx, reg_num: %d\n", dut_mmios.mycpu_mmios[0] || dut_mmios.mycpu_mmios[1] || dut_mmios.mycpu_mmios[2], dut->io_difftest_we, dut->io_difftest_wdata, dut->io_difftest_wdest);
-            qemu_getregs(conn, &regs);
-            regs.gpr[dut->io_difftest_wdest] = dut->io_difftest_wdata;
-            qemu_setregs(conn, &regs);
-        }
-        if (dut->io_difftest_int) {
-            qemu_enable_int(conn);
-        }
+    // QEMU inherits the listening socket, so no fixed port and no waiting
+    // for it to come up before we can connect
+    int servfd = -1;
+    if (difftest_ring_plugin && !ring_off) {
+        extern uint64_t elf_entry;
+        qemu_ring = ring_create(qemu_ring_name, sizeof(qemu_ring_name), elf_entry);
+    } else {
+        servfd = difftest_gdb_tcp ? get_free_servfd() : get_free_unix_servfd();
+    }
+    int ppid = getpid();
+    int result = 0;
 
-        qemu_getregs(conn, &regs);
-        dut_getregs(&dut_regs);
-        dut_getpcs(&dut_pcs);
+    if (qemu_ring) {
+        printf("Welcome to ZJV2 differential test with QEMU streaming through %s!\n", difftest_ring_plugin);
+    } else {
+        printf("Welcome to ZJV2 differential test with QEMU!\n");
+    }
 
-        if (!difftest_regs(&regs, &dut_regs, &dut_pcs)) {
-            sleep(1);
-            printf("\nQEMU\n");
-            // qemu_getmem(conn, 0x200bff8);
-            // qemu_getmem(conn, 0x2004000);
-            print_qemu_registers(&regs, true);
-            printf("\nDUT\n");
-            for (int i = 0; i < 3; i++) {
-                printf("$pc_%d:0x%016lx  ", i, dut_pcs.mycpu_pcs[i]);
-            }
-            printf("\n");
-            print_qemu_registers(&dut_regs, false);
-            printf("\n");
-            result = 1;
-            break;
+    pid_t pid = fork();
+    if (pid != 0) {       // child process
+        result = difftest_run(path, servfd);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        if (qemu_ring) {
+            ring_failed |= result != 0;
+            ring_destroy(qemu_ring, qemu_ring_name);
+            qemu_ring = NULL;
         }
+    } else {              // parent process
+        difftest_start_qemu(path, servfd, ppid);
     }
-    END:
-#ifdef WAVE_TRACE
-    dut_step(3, vfp, contextp);
-    vfp->close();
-    delete vfp;
-    delete contextp;
-#endif
-    qemu_disconnect(conn);
 
     return result;
 }
 
-int difftest(const char *path) {
-    int port = 1234;
-    int ppid = getpid();
-    int result = 0;
-
-    printf("Welcome to ZJV2 differential test with QEMU!\n");
+// forget the state of a finished run before the next one
+static void difftest_reset() {
+    total_instructions = 0;
+    unchecked_groups = 0;
+    interval_start = 0;
+    interval_hits.clear();
+    interval_count = 0;
+    mem_checked_at = 0;
+    mem_final = false;
+}
 
-    if (fork() != 0) {    // child process
-        result = difftest_body(path, port);
-    } else {              // parent process
-        difftest_start_qemu(path, port, ppid);
+int difftest(const char *path) {
+    int result = difftest_once(path);
+    if (golden_stale) {
+        // the DUT took another interrupt or read another MMIO value than the
+        // recording, from there on only the live reference knows what to do.
+        // Run against it from the start, which records a new trace.
+        printf("Running again against the live reference\n");
+        unlink(golden_file);
+        golden_stale = false;
+        difftest_reset();
+        result = difftest_once(path);
+    }
+    if (ring_failed) {
+        // QEMU ran ahead on its own: it can't take the DUT's interrupts or
+        // MMIO values, and may have taken its own.  Stepped over GDB it
+        // can, and it has the last word on every failure.
+        printf("Running again with QEMU over GDB\n");
+        ring_failed = false;
+        ring_off = true;
+        difftest_reset();
+        result = difftest_once(path);
+    }
+    if (result != DIFFTEST_DIVERGED) {
+        return result;
     }
 
-    return result;
+    // neither side can be rolled back in place, but both are deterministic:
+    // run again to the last boundary that matched and go commit by commit
+    // from there to pinpoint the instruction
+    printf("Diverged after the boundary at %lu instructions, replaying from there commit by commit\n",
+           interval_start);
+    replaying = true;
+    replay_from = interval_start;
+    difftest_reset();
+
+    result = difftest_once(path);
+    return result == DIFFTEST_DIVERGED ? 1 : result;
 }
@@ -2,50 +2,29 @@
 #include <iostream>
 
 VTileForVerilator *dut;
+dut_group_t dut_groups[DUT_RUN_MAX];
 
-void dut_reset(int cycle, VerilatedVcdC *vfp, VerilatedContext *context) {
+void dut_reset(int cycle, Wave *wave, VerilatedContext *context) {
     for (int i = 0; i < cycle; i++) {
         dut->reset = 1;
         dut->clock = 0;
         dut->eval();
         context->timeInc(1);
-        vfp->dump(context->time());
+        if (wave) wave->dump(context->time());
         dut->clock = 1;
         dut->eval();
         dut->reset = 0;
         context->timeInc(1);
-        vfp->dump(context->time());
+        if (wave) wave->dump(context->time());
     }
 }
 
 int dut_commit() {
     int commit = (dut->io_difftest_valids_0 != 0) + (dut->io_difftest_valids_1 != 0) + (dut->io_difftest_valids_2 != 0);
 
-#ifdef TRACE
-    std::cout << "DUT commits " << commit << " instructions" << std::endl;
-#endif
-    
     return commit;
 }
 
-void dut_step(int cycle, VerilatedVcdC *vfp, VerilatedContext *context) {
-
-#ifdef TRACE
-    std::cout << "DUT one cycle" << std::endl;
-#endif
-
-    for (int i = 0; i < cycle; i++) {
-        dut->clock = 0;
-        dut->eval();
-        context->timeInc(1);
-        vfp->dump(context->time());
-        dut->clock = 1;
-        dut->eval();
-        context->timeInc(1);
-        vfp->dump(context->time());
-    }
-}
-
 void dut_getmmios(diff_mmios *mmios) {
     mmios->mycpu_mmios[0] = dut->io_difftest_mmio_0;
     mmios->mycpu_mmios[1] = dut->io_difftest_mmio_1;
@@ -152,6 +131,3 @@ void dut_getregs(qemu_regs_t *regs) {
     regs->array[81] = dut->io_difftest_csrs_stval;
 }
 
-void dut_write_counter(int value) {
-    // TODO have to write the GPR and the counter (timer interrupt), GPR for mfc0, counter for every step to keep up with qemu
-}
@@ -0,0 +1,121 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "elf_image.h"
+
+// hex entries per line of testfile.hex, $readmemh takes any whitespace
+#define HEX_PER_LINE 16
+
+elf_image_t *elf_image_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("can't open %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Elf64_Ehdr)) {
+        printf("%s isn't a RV64 ELF\n", path);
+        close(fd);
+        return NULL;
+    }
+    uint8_t *map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("can't map %s\n", path);
+        return NULL;
+    }
+
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *) map;
+    uint64_t size = st.st_size;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_machine != EM_RISCV || eh->e_phoff + (uint64_t) eh->e_phnum * sizeof(Elf64_Phdr) > size) {
+        printf("%s isn't a RV64 ELF\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    elf_image_t *image = (elf_image_t *) calloc(1, sizeof(elf_image_t));
+    assert(image != NULL);
+    image->map = map;
+    image->map_size = st.st_size;
+    image->entry = eh->e_entry;
+
+    const Elf64_Phdr *ph = (const Elf64_Phdr *) (map + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) {
+            continue;
+        }
+        if (ph[i].p_offset + ph[i].p_filesz > size || ph[i].p_filesz > ph[i].p_memsz ||
+            image->nsegs == ELF_IMAGE_SEGS) {
+            printf("%s has a program header we can't load\n", path);
+            elf_image_close(image);
+            return NULL;
+        }
+        elf_seg_t *seg = &image->segs[image->nsegs++];
+        seg->paddr = ph[i].p_paddr;
+        seg->data = map + ph[i].p_offset;
+        seg->filesz = ph[i].p_filesz;
+        seg->memsz = ph[i].p_memsz;
+    }
+    return image;
+}
+
+void elf_image_close(elf_image_t *image) {
+    munmap(image->map, image->map_size);
+    free(image);
+}
+
+bool elf_image_write_hex(const elf_image_t *image, const char *path) {
+    uint64_t lo = UINT64_MAX, hi = 0;
+    for (int i = 0; i < image->nsegs; i++) {
+        const elf_seg_t *seg = &image->segs[i];
+        if (seg->filesz == 0) {
+            continue;
+        }
+        lo = seg->paddr < lo ? seg->paddr : lo;
+        hi = seg->paddr + seg->filesz > hi ? seg->paddr + seg->filesz : hi;
+    }
+    if (lo > hi) {
+        lo = hi = 0;
+    }
+
+    // the flat binary objcopy would have written
+    size_t len = hi - lo;
+    uint8_t *bin = (uint8_t *) calloc(len ? len : 1, 1);
+    assert(bin != NULL);
+    for (int i = 0; i < image->nsegs; i++) {
+        const elf_seg_t *seg = &image->segs[i];
+        if (seg->filesz) {
+            memcpy(bin + (seg->paddr - lo), seg->data, seg->filesz);
+        }
+    }
+
+    // "xx" and a separator per byte, formatted in one pass and written at once
+    char *text = (char *) malloc(len * 3 + 1);
+    assert(text != NULL);
+    static const char digits[] = "0123456789abcdef";
+    char *p = text;
+    for (size_t i = 0; i < len; i++) {
+        *p++ = digits[bin[i] >> 4];
+        *p++ = digits[bin[i] & 0xf];
+        *p++ = (i % HEX_PER_LINE == HEX_PER_LINE - 1 || i + 1 == len) ? '\n' : ' ';
+    }
+    free(bin);
+
+    FILE *fp = fopen(path, "w");
+    bool ok = fp != NULL && fwrite(text, 1, p - text, fp) == (size_t) (p - text);
+    if (fp != NULL) {
+        ok &= fclose(fp) == 0;
+    }
+    free(text);
+    if (!ok) {
+        printf("can't write %s\n", path);
+    }
+    return ok;
+}
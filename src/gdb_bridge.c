@@ -8,6 +8,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/signal.h>
 #include <unistd.h>
@@ -39,14 +40,12 @@ void start_bridge(int port, int serv_port) {
         printf("'%s'\n", data);
         printf("\n");
         gdb_send(server, (void *) data, size);
-        free(data);
 
         data = (char *) (void *) gdb_recv(server, &size);
         printf("$ message: server --> client:%lx:\n", size);
         printf("'%s'\n", data);
         gdb_send(client, (void *) data, size);
         printf("\n\n");
-        free(data);
     }
 }
 
@@ -56,7 +55,7 @@ int get_free_servfd() {
 
     sa.sin_family = AF_INET;
     sa.sin_port = 0;
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
     // open the socket and start the tcp connection
     int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -64,6 +63,30 @@ int get_free_servfd() {
         close(fd);
         panic("bind");
     }
+    // listening before the server exists lets clients connect right away
+    if (listen(fd, 5) != 0) {
+        close(fd);
+        panic("listen");
+    }
+    return fd;
+}
+
+int get_free_unix_servfd() {
+    // an abstract address (leading NUL) leaves nothing in the filesystem
+    // and is released with the last fd, the kernel picks a free name
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (bind(fd, (const struct sockaddr *) &sa, sizeof(sa_family_t)) != 0) {
+        close(fd);
+        panic("bind");
+    }
+    if (listen(fd, 5) != 0) {
+        close(fd);
+        panic("listen");
+    }
     return fd;
 }
 
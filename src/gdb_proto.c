@@ -19,6 +19,7 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -33,16 +34,64 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include "common.h"
 #include "gdb_proto.h"
+#include "hex_codec.h"
+#include "prof.h"
+
+// requests posted but not yet collected, must be a power of two
+#define GDB_QUEUE_DEPTH 256
+
+// NACKed packets/replies resent in ack mode before giving up
+#define GDB_MAX_RETRIES 8
+
+// initial sizes of the per-connection buffers, they grow on demand
+#define GDB_RX_SIZE 65536
+#define GDB_TX_SIZE 4096
 
 struct gdb_conn {
-  FILE *in;
-  FILE *out;
+  int fd;
   bool ack;
+
+  // bytes read from the socket, [rx_head, rx_tail) is still unparsed.
+  // Replies are views into this buffer, or into `reply` when the payload
+  // had escapes or RLE to expand, and stay valid until the next receive.
+  uint8_t *rx;
+  size_t rx_size;
+  size_t rx_head;
+  size_t rx_tail;
+  uint8_t *reply;
+  size_t reply_size;
+
+  // posted packets and pending ACKs, written out by a single write()
+  uint8_t *tx;
+  size_t tx_size;
+  size_t tx_len;
+
+  // pipelined requests, replies arrive in posting order
+  bool discard[GDB_QUEUE_DEPTH]; // drop the reply instead of returning it
+  size_t head;                   // next reply to collect
+  size_t tail;                   // next request to post
+
+  // --profile: packet type and when it went out, [head, flushed) were sent
+  uint8_t type[GDB_QUEUE_DEPTH];
+  uint64_t sent_at[GDB_QUEUE_DEPTH];
+  size_t flushed;
+  uint8_t send_type;             // of the blocking gdb_send()
+  uint64_t send_at;
+
+  struct gdb_stats stats;
 };
 
+static void *xrealloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL)
+    err(1, "realloc");
+  return ptr;
+}
 
 static uint8_t hex_nibble(uint8_t hex) {
   return isdigit(hex) ? hex - '0' : tolower(hex) - 'a' + 10;
@@ -59,24 +108,11 @@ uint16_t gdb_decode_hex(uint8_t msb, uint8_t lsb) {
 }
 
 uint64_t gdb_decode_hex_str(uint8_t *bytes) {
-  uint64_t value = 0;
-  uint64_t weight = 1;
-  while (isxdigit(bytes[0]) && isxdigit(bytes[1])) {
-    value += weight * gdb_decode_hex(bytes[0], bytes[1]);
-    bytes += 2;
-    weight *= 16 * 16;
-  }
-  return value;
+  return hex_decode_le64(bytes, strnlen((const char *) bytes, 16));
 }
 
 inst_t gdb_decode_inst(uint8_t *bytes) {
-  uint32_t value = 0;
-  uint32_t weight = 1;
-  while (isxdigit(bytes[0]) && isxdigit(bytes[1])) {
-    value += weight * gdb_decode_hex(bytes[0], bytes[1]);
-    bytes += 2;
-    weight *= 16 * 16;
-  }
+  uint32_t value = hex_decode_le64(bytes, strnlen((const char *) bytes, 8));
 
   inst_t inst;
   inst.val = value;
@@ -86,31 +122,91 @@ inst_t gdb_decode_inst(uint8_t *bytes) {
 
 
 
-static struct gdb_conn* gdb_begin(int fd) {
+static void write_all(struct gdb_conn *conn, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(conn->fd, iov, iovcnt);
+    conn->stats.flushes++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "send");
+    }
+    conn->stats.bytes_sent += n;
+
+    // partial write: skip what went out and retry with the rest
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+static void write_byte(struct gdb_conn *conn, uint8_t c) {
+  struct iovec iov = { &c, 1 };
+  write_all(conn, &iov, 1);
+}
+
+// read at least one more byte into the receive buffer
+static void fill(struct gdb_conn *conn) {
+  if (conn->rx_head > 0) {
+    memmove(conn->rx, conn->rx + conn->rx_head, conn->rx_tail - conn->rx_head);
+    conn->rx_tail -= conn->rx_head;
+    conn->rx_head = 0;
+  }
+  if (conn->rx_tail == conn->rx_size) {
+    conn->rx_size *= 2;
+    conn->rx = (uint8_t *)xrealloc(conn->rx, conn->rx_size);
+  }
+
+  ssize_t n;
+  do {
+    n = read(conn->fd, conn->rx + conn->rx_tail, conn->rx_size - conn->rx_tail);
+    conn->stats.reads++;
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    err(1, "recv");
+  else if (n == 0)
+    errx(1, "recv: Connection closed");
+
+  conn->rx_tail += n;
+  conn->stats.bytes_recv += n;
+}
+
+static int read_byte(struct gdb_conn *conn) {
+  if (conn->rx_head == conn->rx_tail)
+    fill(conn);
+  return conn->rx[conn->rx_head++];
+}
+
+static struct gdb_conn *conn_alloc(int fd) {
   struct gdb_conn *conn = (struct gdb_conn *)calloc(1, sizeof(struct gdb_conn));
   if (conn == NULL)
     err(1, "calloc");
 
+  conn->fd = fd;
   conn->ack = true;
 
-  // duplicate the handle to separate read/write state
-  int fd2 = dup(fd);
-  if (fd2 < 0)
-    err(1, "dup");
+  conn->rx_size = GDB_RX_SIZE;
+  conn->rx = (uint8_t *)xrealloc(NULL, conn->rx_size);
+  conn->reply_size = GDB_RX_SIZE;
+  conn->reply = (uint8_t *)xrealloc(NULL, conn->reply_size);
+  conn->tx_size = GDB_TX_SIZE;
+  conn->tx = (uint8_t *)xrealloc(NULL, conn->tx_size);
 
-  // open a FILE* for reading
-  conn->in = fdopen(fd, "rb");
-  if (conn->in == NULL)
-    err(1, "fdopen");
+  return conn;
+}
 
-  // open a FILE* for writing
-  conn->out = fdopen(fd2, "wb");
-  if (conn->out == NULL)
-    err(1, "fdopen");
+static struct gdb_conn* gdb_begin(int fd) {
+  struct gdb_conn *conn = conn_alloc(fd);
 
   // reset line state by acking any earlier input
-  fputc('+', conn->out);
-  fflush(conn->out);
+  write_byte(conn, '+');
 
   return conn;
 }
@@ -128,27 +224,7 @@ struct gdb_conn *gdb_begin_server(int fd) {
     err(1, "accept");
   }
 
-  struct gdb_conn *conn = (struct gdb_conn *)calloc(1, sizeof(struct gdb_conn));
-  if (conn == NULL)
-    err(1, "calloc");
-
-  conn->ack = true;
-
-  // duplicate the handle to separate read/write state
-  int connfd2 = dup(connfd);
-  if (connfd2 < 0)
-    err(1, "dup");
-
-  // open a FILE* for reading
-  conn->in = fdopen(connfd, "rb");
-  if (conn->in == NULL)
-    err(1, "fdopen");
-
-  // open a FILE* for writing
-  conn->out = fdopen(connfd2, "wb");
-  if (conn->out == NULL)
-    err(1, "fdopen");
-  return conn;
+  return conn_alloc(connfd);
 }
 
 
@@ -168,35 +244,7 @@ struct gdb_conn *gdb_server_start(uint16_t port) {
 	return NULL;
   }
   
-  // accept user connect
-  listen(fd, 5);
-
-  struct sockaddr_in client_addr;
-  socklen_t length = sizeof(client_addr);
-  int connfd = accept(fd, (struct sockaddr*)&client_addr, &length);
-
-  if(connfd < 0) { err(1, "accept"); }
-
-  struct gdb_conn *conn = (struct gdb_conn *)calloc(1, sizeof(struct gdb_conn));
-  if (conn == NULL) err(1, "calloc");
-
-  conn->ack = true;
-
-  // duplicate the handle to separate read/write state
-  int connfd2 = dup(connfd);
-  if (connfd2 < 0)
-    err(1, "dup");
-
-  // open a FILE* for reading
-  conn->in = fdopen(connfd, "rb");
-  if (conn->in == NULL)
-    err(1, "fdopen");
-
-  // open a FILE* for writing
-  conn->out = fdopen(connfd2, "wb");
-  if (conn->out == NULL)
-    err(1, "fdopen");
-  return conn;
+  return gdb_begin_server(fd);
 }
 
 struct gdb_conn* gdb_begin_inet(const char *addr, uint16_t port) {
@@ -236,169 +284,367 @@ struct gdb_conn* gdb_begin_inet(const char *addr, uint16_t port) {
 }
 
 
+struct gdb_conn *gdb_begin_listener(int listen_fd) {
+  // connect to wherever the listener is bound, the kernel queues us in its
+  // backlog until the owner of the listener gets around to accept()
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  if (getsockname(listen_fd, (struct sockaddr *)&sa, &len) != 0)
+    err(1, "getsockname");
+
+  int fd = socket(sa.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    err(1, "socket");
+  if (connect(fd, (const struct sockaddr *)&sa, len) != 0)
+    err(1, "connect");
+
+  if (sa.ss_family == AF_INET) {
+    int tmp = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&tmp, sizeof(tmp))) {
+      perror("setsockopt");
+      panic("setsockopt error");
+    }
+  }
+
+  return gdb_begin(fd);
+}
+
+
 void gdb_end(struct gdb_conn *conn) {
-  fclose(conn->in);
-  fclose(conn->out);
+  close(conn->fd);
+  free(conn->rx);
+  free(conn->reply);
+  free(conn->tx);
   free(conn);
 }
 
-static void send_packet(FILE *out, const uint8_t *command, size_t size) {
-  // compute the checksum -- simple mod256 addition
+static uint8_t checksum(const uint8_t *data, size_t size) {
+  // simple mod256 addition
   uint8_t sum = 0;
-  size_t i;
-  for (i = 0; i < size; ++i)
-    sum += command[i];
+  for (size_t i = 0; i < size; ++i)
+    sum += data[i];
+  return sum;
+}
 
-  // NB: seems neither escaping nor RLE is generally expected by
-  // gdbserver.  e.g. giving "invalid hex digit" on an RLE'd address.
-  // So just write raw here, and maybe let higher levels escape/RLE.
+// NB: seems neither escaping nor RLE is generally expected by
+// gdbserver.  e.g. giving "invalid hex digit" on an RLE'd address.
+// So just write raw here, and maybe let higher levels escape/RLE.
 
-  fputc('$', out); // packet start
-  fwrite(command, 1, size, out); // payload
-  fprintf(out, "#%02X", sum); // packet end, checksum
-  fflush(out);
+static void send_packet(struct gdb_conn *conn, const uint8_t *command, size_t size) {
+  uint8_t sum = checksum(command, size);
+  uint8_t start = '$';
+  uint8_t end[3] = { '#', hex_encode(sum >> 4), hex_encode(sum & 0xf) };
 
-  if (ferror(out))
-    err(1, "send");
-  else if (feof(out))
-    errx(0, "send: Connection closed");
+  // the payload goes out straight from the caller's buffer
+  struct iovec iov[3] = {
+    { &start, 1 },
+    { (void *)command, size },
+    { end, sizeof(end) },
+  };
+  write_all(conn, iov, 3);
+  conn->stats.packets_sent++;
+}
+
+static void tx_reserve(struct gdb_conn *conn, size_t size) {
+  while (conn->tx_len + size > conn->tx_size) {
+    conn->tx_size *= 2;
+    conn->tx = (uint8_t *)xrealloc(conn->tx, conn->tx_size);
+  }
 }
 
+// queue a packet to go out on the next flush_posted()
+static void append_packet(struct gdb_conn *conn, const uint8_t *command, size_t size) {
+  uint8_t sum = checksum(command, size);
+
+  tx_reserve(conn, size + 4);
+  uint8_t *p = conn->tx + conn->tx_len;
+  *p++ = '$';
+  memcpy(p, command, size);
+  p += size;
+  *p++ = '#';
+  *p++ = hex_encode(sum >> 4);
+  *p++ = hex_encode(sum & 0xf);
+  conn->tx_len = p - conn->tx;
+  conn->stats.packets_sent++;
+}
+
+static uint8_t* recv_packet(struct gdb_conn *conn, size_t *ret_size, bool* ret_sum_ok);
+
 void gdb_send(struct gdb_conn *conn, const uint8_t *command, size_t size) {
+  // the ACK would be mixed up with the replies still in flight
+  gdb_drain(conn);
+
   bool acked = false;
+  int retries = 0;
+  conn->send_type = command[0];
+  conn->send_at = PROF_BEGIN();
   do {
-    send_packet(conn->out, command, size);
+    send_packet(conn, command, size);
 
-    if (!conn->ack)
+    if (!conn->ack) {
+      // the blocking wait for the '+' is gone
+      conn->stats.acks_saved++;
+      conn->stats.syscalls_saved++;
       break;
+    }
 
     // look for '+' ACK or '-' NACK/resend
-    acked = fgetc(conn->in) == '+';
+    acked = read_byte(conn) == '+';
+    if (!acked && ++retries > GDB_MAX_RETRIES)
+      errx(1, "send: Packet NACKed %d times", retries);
   } while (!acked);
 }
 
-static uint8_t* recv_packet(FILE *in, size_t *ret_size, bool* ret_sum_ok) {
+// expand escapes and run-length encoding of a payload into conn->reply
+static uint8_t *decode_payload(struct gdb_conn *conn, const uint8_t *payload,
+                               size_t size, size_t *ret_size) {
   size_t i = 0;
-  size_t size = 4096;
-  uint8_t *reply = (uint8_t *)malloc(size);
-  if (reply == NULL)
-    err(1, "malloc");
-
-  int c;
-  uint8_t sum = 0;
-  bool escape = false;
-
-  // fast-forward to the first start of packet
-  while ((c = fgetc(in)) != EOF && c != '$');
-
-  while ((c = fgetc(in)) != EOF) {
-    sum += c;
-    switch (c) {
-      case '$': // new packet?  start over...
-        i = 0;
-        sum = 0;
-        escape = false;
-        continue;
+  for (size_t j = 0; j < size; j++) {
+    // worst case of one input byte is a run of 126 - 29 characters
+    if (i + 128 > conn->reply_size) {
+      conn->reply_size *= 2;
+      conn->reply = (uint8_t *)xrealloc(conn->reply, conn->reply_size);
+    }
 
-      case '#': // end of packet
-        sum -= c; // not part of the checksum
-        {
-          uint8_t msb = fgetc(in);
-          uint8_t lsb = fgetc(in);
-          *ret_sum_ok = sum == gdb_decode_hex(msb, lsb);
-        }
-        *ret_size = i;
-
-        // terminate it for good measure
-        if (i == size) {
-          reply = (uint8_t *)realloc(reply, size + 1);
-          if (reply == NULL)
-            err(1, "realloc");
-        }
-        reply[i] = '\0';
-
-        return reply;
-
-      case '}': // escape: next char is XOR 0x20
-        escape = true;
+    uint8_t c = payload[j];
+    if (c == '}' && j + 1 < size) { // escape: next char is XOR 0x20
+      conn->reply[i++] = payload[++j] ^ 0x20;
+    } else if (c == '*' && i > 0 && j + 1 < size) {
+      // run-length-encoding
+      // The next character tells how many times to repeat the last
+      // character we saw.  The count is added to 29, so that the
+      // minimum-beneficial RLE 3 is the first printable character ' '.
+      // The count character can't be >126 or '$'/'#' packet markers.
+      uint8_t c2 = payload[j + 1];
+      if (c2 < 29 || c2 > 126 || c2 == '$' || c2 == '#') { // invalid count character!
+        conn->reply[i++] = c;
         continue;
-
-      case '*': // run-length-encoding
-        // The next character tells how many times to repeat the last
-        // character we saw.  The count is added to 29, so that the
-        // minimum-beneficial RLE 3 is the first printable character ' '.
-        // The count character can't be >126 or '$'/'#' packet markers.
-
-        if (i > 0) { // need something to repeat!
-          int c2 = fgetc(in);
-          if (c2 < 29 || c2 > 126 || c2 == '$' || c2 == '#') {
-            // invalid count character!
-            ungetc(c2, in);
-          } else {
-            int count = c2 - 29;
-
-            // get a bigger buffer if needed
-            if (i + count > size) {
-              size *= 2;
-              reply = (uint8_t *)realloc(reply, size);
-              if (reply == NULL)
-                err(1, "realloc");
-            }
-
-            // fill the repeated character
-            memset(&reply[i], reply[i - 1], count);
-            i += count;
-            sum += c2;
-            continue;
-          }
-        }
+      }
+      j++;
+      memset(&conn->reply[i], conn->reply[i - 1], c2 - 29);
+      i += c2 - 29;
+    } else {
+      conn->reply[i++] = c;
     }
+  }
+  conn->reply[i] = '\0';
+  *ret_size = i;
+  return conn->reply;
+}
 
-    // XOR an escaped character
-    if (escape) {
-      c ^= 0x20;
-      escape = false;
+static uint8_t* recv_packet(struct gdb_conn *conn, size_t *ret_size, bool* ret_sum_ok) {
+  for (;;) {
+    uint8_t *rx = conn->rx + conn->rx_head;
+    size_t avail = conn->rx_tail - conn->rx_head;
+
+    // fast-forward to the first start of packet, dropping ACKs on the way
+    uint8_t *start = (uint8_t *)memchr(rx, '$', avail);
+    if (start == NULL) {
+      conn->rx_head = conn->rx_tail;
+      fill(conn);
+      continue;
+    }
+    conn->rx_head = start - conn->rx;
+    avail -= start - rx;
+
+    // wait for the whole packet, checksum included
+    uint8_t *end = (uint8_t *)memchr(start + 1, '#', avail - 1);
+    if (end == NULL || end + 3 > conn->rx + conn->rx_tail) {
+      fill(conn);
+      continue;
     }
 
-    // get a bigger buffer if needed
-    if (i == size) {
-      size *= 2;
-      reply = (uint8_t *)realloc(reply, size);
-      if (reply == NULL)
-        err(1, "realloc");
+    // new packet?  start over...
+    uint8_t *restart = (uint8_t *)memrchr(start + 1, '$', end - start - 1);
+    if (restart != NULL) {
+      conn->rx_head = restart - conn->rx;
+      continue;
     }
 
-    // add one character
-    reply[i++] = c;
-  }
+    uint8_t *payload = start + 1;
+    size_t size = end - payload;
+    *ret_sum_ok = checksum(payload, size) == gdb_decode_hex(end[1], end[2]);
+    conn->rx_head = end + 3 - conn->rx;
 
-  if (ferror(in))
-    err(1, "recv");
-  else if (feof(in))
-    errx(0, "recv: Connection closed");
-  else
-    errx(1, "recv: Unknown connection error");
+    conn->stats.packets_recv++;
+    if (!*ret_sum_ok)
+      conn->stats.bad_checksums++;
+
+    if (memchr(payload, '}', size) == NULL && memchr(payload, '*', size) == NULL) {
+      // nothing to expand, hand out the payload in place
+      *end = '\0';
+      *ret_size = size;
+      return payload;
+    }
+    return decode_payload(conn, payload, size, ret_size);
+  }
 }
 
 uint8_t* gdb_recv(struct gdb_conn *conn, size_t *size) {
+  gdb_drain(conn);
+
   uint8_t *reply;
   bool acked = false;
+  int retries = 0;
   do {
-    reply = recv_packet(conn->in, size, &acked);
-
-    if (!conn->ack)
+    reply = recv_packet(conn, size, &acked);
+
+    if (!conn->ack) {
+      // nobody can resend it, so a corrupt reply is fatal
+      if (!acked)
+        errx(1, "recv: Bad checksum in reply '%s'", reply);
+      // the '+' and its write are gone
+      conn->stats.acks_saved++;
+      conn->stats.syscalls_saved++;
       break;
+    }
 
-    if (reply && !acked) free(reply);
+    if (!acked) {
+      warnx("recv: Bad checksum in reply '%s', asking for a resend", reply);
+      if (++retries > GDB_MAX_RETRIES)
+        errx(1, "recv: Reply corrupted %d times", retries);
+    }
 
     // send +/- depending on checksum result, retry if needed
-    fputc(acked ? '+' : '-', conn->out);
-    fflush(conn->out);
+    write_byte(conn, acked ? '+' : '-');
   } while (!acked);
 
+  if (UNLIKELY(prof_enabled))
+    prof_packet(conn->send_type, prof_ticks() - conn->send_at);
+  return reply;
+}
+
+static void flush_posted(struct gdb_conn *conn) {
+  if (conn->tx_len == 0)
+    return;
+
+  struct iovec iov = { conn->tx, conn->tx_len };
+  write_all(conn, &iov, 1);
+  conn->tx_len = 0;
+
+  if (UNLIKELY(prof_enabled)) {
+    uint64_t now = prof_ticks();
+    for (; conn->flushed != conn->tail; conn->flushed++)
+      conn->sent_at[conn->flushed % GDB_QUEUE_DEPTH] = now;
+  }
+}
+
+static void post(struct gdb_conn *conn, const uint8_t *command, size_t size,
+                 bool discard) {
+  if (conn->tail - conn->head == GDB_QUEUE_DEPTH)
+    errx(1, "post: more than %d requests in flight", GDB_QUEUE_DEPTH);
+
+  append_packet(conn, command, size);
+  conn->discard[conn->tail % GDB_QUEUE_DEPTH] = discard;
+  conn->type[conn->tail % GDB_QUEUE_DEPTH] = command[0];
+  conn->tail++;
+}
+
+// the ACK in front of each reply is skipped by recv_packet() while looking
+// for the '$', so a bad checksum can't be fixed by a NACK here: the server
+// would resend its latest reply, not the broken one
+static uint8_t *collect(struct gdb_conn *conn, size_t *size) {
+  bool sum_ok;
+  uint8_t *reply = recv_packet(conn, size, &sum_ok);
+  if (!sum_ok)
+    errx(1, "recv: Bad checksum in pipelined reply '%s'", reply);
+
+  if (conn->ack) {
+    tx_reserve(conn, 1);
+    conn->tx[conn->tx_len++] = '+'; // goes out with the next flush
+  } else {
+    conn->stats.acks_saved++;
+  }
+  if (UNLIKELY(prof_enabled)) {
+    size_t i = conn->head % GDB_QUEUE_DEPTH;
+    prof_packet(conn->type[i], prof_ticks() - conn->sent_at[i]);
+  }
+  conn->head++;
   return reply;
 }
 
+static void collect_discarded(struct gdb_conn *conn) {
+  while (conn->head != conn->tail && conn->discard[conn->head % GDB_QUEUE_DEPTH]) {
+    size_t size;
+    uint8_t *reply = collect(conn, &size);
+    if (reply[0] == 'E')
+      warnx("recv: Discarded reply reports error '%s'", reply);
+  }
+}
+void gdb_post(struct gdb_conn *conn, const uint8_t *command, size_t size) {
+  post(conn, command, size, false);
+}
+
+void gdb_post_discard(struct gdb_conn *conn, const uint8_t *command, size_t size) {
+  post(conn, command, size, true);
+}
+
+void gdb_flush(struct gdb_conn *conn) {
+  flush_posted(conn);
+}
+
+uint8_t *gdb_collect(struct gdb_conn *conn, size_t *size) {
+  flush_posted(conn);
+  collect_discarded(conn);
+  assert(conn->head != conn->tail);
+
+  return collect(conn, size);
+}
+
+// whether a whole packet (checksum included) is already buffered
+static bool have_packet(struct gdb_conn *conn) {
+  uint8_t *rx = conn->rx + conn->rx_head;
+  size_t avail = conn->rx_tail - conn->rx_head;
+  uint8_t *start = (uint8_t *)memchr(rx, '$', avail);
+  if (start == NULL)
+    return false;
+  uint8_t *end = (uint8_t *)memchr(start, '#', rx + avail - start);
+  return end != NULL && end + 3 <= rx + avail;
+}
+
+uint8_t *gdb_collect_timeout(struct gdb_conn *conn, size_t *size, int timeout_ms) {
+  flush_posted(conn);
+  collect_discarded(conn);
+  assert(conn->head != conn->tail);
+
+  while (!have_packet(conn)) {
+    struct pollfd pfd = { conn->fd, POLLIN, 0 };
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r == 0)
+      return NULL;
+    if (r < 0 && errno != EINTR)
+      err(1, "poll");
+    if (r > 0)
+      fill(conn);
+  }
+  return collect(conn, size);
+}
+
+void gdb_interrupt(struct gdb_conn *conn) {
+  flush_posted(conn);
+  // a bare ^C, the stop reply it causes answers the pending resume
+  write_byte(conn, 0x03);
+}
+
+void gdb_drain(struct gdb_conn *conn) {
+  flush_posted(conn);
+  collect_discarded(conn);
+  assert(conn->head == conn->tail);
+  flush_posted(conn);
+}
+
+size_t gdb_pending(struct gdb_conn *conn) {
+  return conn->tail - conn->head;
+}
+
+const struct gdb_stats *gdb_get_stats(struct gdb_conn *conn) {
+  return &conn->stats;
+}
+
+bool gdb_acking(struct gdb_conn *conn) {
+  return conn->ack;
+}
+
 const char* gdb_start_noack(struct gdb_conn *conn) {
   static const char cmd[] = "QStartNoAckMode";
   gdb_send(conn, (const uint8_t *)cmd, sizeof(cmd) - 1);
@@ -406,7 +652,6 @@ const char* gdb_start_noack(struct gdb_conn *conn) {
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
   bool ok = size == 2 && !strcmp((const char*)reply, "OK");
-  free(reply);
 
   if (ok)
     conn->ack = false;
@@ -0,0 +1,240 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "golden.h"
+
+#define GOLDEN_MAGIC "ZJVGLD01"
+
+// a record is a byte of flags and the number of registers changed besides
+// the pc (GOLDEN_MANY: a byte with the number follows), the distance of the
+// pc from the fall-through one, zigzag-LEB128, and per register its index and
+// the LEB128 of new ^ old value
+#define GOLDEN_FLAG_BITS 2
+#define GOLDEN_MANY      ((1 << (8 - GOLDEN_FLAG_BITS)) - 1)
+
+typedef struct {
+    char magic[8];
+    uint64_t records;
+    uint64_t size;              // bytes of records after the header
+    qemu_regs_t initial;
+} golden_header_t;
+
+struct golden {
+    qemu_regs_t state;
+
+    // recording
+    qemu_regs_t initial;
+    FILE *fp;
+    char *path;
+    uint64_t records;
+    uint64_t size;
+
+    // replay
+    uint8_t *map;
+    size_t map_size;
+    const uint8_t *p, *end;
+};
+
+char *golden_path(const char *dir, const char *elf) {
+    FILE *fp = fopen(elf, "rb");
+    if (fp == NULL) {
+        panic("can't read %s", elf);
+    }
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325UL;
+    int c;
+    while ((c = getc(fp)) != EOF) {
+        hash = (hash ^ (uint8_t) c) * 0x100000001b3UL;
+    }
+    fclose(fp);
+
+    char *path = (char *) malloc(strlen(dir) + 32);
+    assert(path != NULL);
+    sprintf(path, "%s/%016lx.golden", dir, hash);
+    return path;
+}
+
+static void put_uleb(golden_t *g, uint64_t v) {
+    do {
+        uint8_t byte = v & 0x7f;
+        v >>= 7;
+        putc(byte | (v ? 0x80 : 0), g->fp);
+        g->size++;
+    } while (v);
+}
+
+static void put_byte(golden_t *g, uint8_t byte) {
+    putc(byte, g->fp);
+    g->size++;
+}
+
+golden_t *golden_create(const char *path, const qemu_regs_t *initial) {
+    golden_t *g = (golden_t *) calloc(1, sizeof(golden_t));
+    assert(g != NULL);
+    g->path = strdup(path);
+    g->initial = *initial;
+    g->state = *initial;
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    g->fp = fopen(tmp, "wb");
+    if (g->fp == NULL) {
+        panic("can't write %s", tmp);
+    }
+    // a placeholder, the header is written last with the counts
+    golden_header_t header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, g->fp);
+    return g;
+}
+
+void golden_append(golden_t *g, int flags, const qemu_regs_t *regs) {
+    int changed = 0;
+    for (int i = 0; i < regs_count; i++) {
+        changed += i != 32 && regs->array[i] != g->state.array[i];
+    }
+    if (changed < GOLDEN_MANY) {
+        put_byte(g, flags | changed << GOLDEN_FLAG_BITS);
+    } else {
+        put_byte(g, flags | GOLDEN_MANY << GOLDEN_FLAG_BITS);
+        put_byte(g, changed);
+    }
+
+    int64_t jump = regs->pc - g->state.pc - (flags & GOLDEN_SYNC ? 0 : 4);
+    put_uleb(g, (uint64_t) jump << 1 ^ (uint64_t) (jump >> 63));
+
+    for (int i = 0; i < regs_count; i++) {
+        if (i != 32 && regs->array[i] != g->state.array[i]) {
+            put_byte(g, i);
+            put_uleb(g, regs->array[i] ^ g->state.array[i]);
+        }
+    }
+    g->state = *regs;
+    g->records++;
+}
+
+void golden_finish(golden_t *g, bool keep) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g->path);
+    if (!keep) {
+        fclose(g->fp);
+        unlink(tmp);
+        free(g->path);
+        free(g);
+        return;
+    }
+
+    golden_header_t header;
+    memcpy(header.magic, GOLDEN_MAGIC, sizeof(header.magic));
+    header.records = g->records;
+    header.size = g->size;
+    header.initial = g->initial;
+    rewind(g->fp);
+    fwrite(&header, sizeof(header), 1, g->fp);
+    fclose(g->fp);
+
+    if (rename(tmp, g->path) != 0) {
+        printf("[golden] can't move %s to %s\n", tmp, g->path);
+    } else {
+        printf("[golden] %lu records, %lu bytes in %s\n", g->records, g->size, g->path);
+    }
+    free(g->path);
+    free(g);
+}
+
+golden_t *golden_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(golden_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    uint8_t *map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const golden_header_t *header = (const golden_header_t *) map;
+    if (memcmp(header->magic, GOLDEN_MAGIC, sizeof(header->magic)) != 0 ||
+        header->size != st.st_size - sizeof(golden_header_t)) {
+        printf("[golden] ignoring %s, it isn't a complete trace\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    golden_t *g = (golden_t *) calloc(1, sizeof(golden_t));
+    assert(g != NULL);
+    g->map = map;
+    g->map_size = st.st_size;
+    g->p = map + sizeof(golden_header_t);
+    g->end = map + st.st_size;
+    g->state = header->initial;
+    printf("[golden] replaying %lu records from %s\n", header->records, path);
+    return g;
+}
+
+const qemu_regs_t *golden_state(golden_t *g) {
+    return &g->state;
+}
+
+// a truncated record ends the trace
+static bool get_uleb(golden_t *g, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; g->p < g->end && shift < 64; shift += 7) {
+        uint8_t byte = *g->p++;
+        *v |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool golden_next(golden_t *g, int *flags) {
+    if (g->p >= g->end) {
+        return false;
+    }
+    uint8_t head = *g->p++;
+    *flags = head & ((1 << GOLDEN_FLAG_BITS) - 1);
+    int changed = head >> GOLDEN_FLAG_BITS;
+    if (changed == GOLDEN_MANY) {
+        if (g->p >= g->end) {
+            return false;
+        }
+        changed = *g->p++;
+    }
+
+    uint64_t zigzag;
+    if (!get_uleb(g, &zigzag)) {
+        return false;
+    }
+    int64_t jump = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+    g->state.pc += jump + (*flags & GOLDEN_SYNC ? 0 : 4);
+
+    for (int i = 0; i < changed; i++) {
+        uint64_t delta;
+        if (g->p >= g->end) {
+            return false;
+        }
+        uint8_t idx = *g->p++;
+        if (idx >= regs_count || !get_uleb(g, &delta)) {
+            return false;
+        }
+        g->state.array[idx] ^= delta;
+    }
+    return true;
+}
+
+void golden_close(golden_t *g) {
+    munmap(g->map, g->map_size);
+    free(g);
+}
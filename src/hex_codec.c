@@ -0,0 +1,190 @@
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HEX_X86
+#endif
+
+#include "hex_codec.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// the value of the digit c, or 0xff
+static inline uint8_t hex_value(uint8_t c) {
+    uint8_t d = c - '0';
+    uint8_t l = (c | 0x20) - 'a';
+    uint8_t v = d < 10 ? d : l + 10;
+    return d < 10 || l < 6 ? v : 0xff;
+}
+
+static void encode_scalar(uint8_t *dst, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[2 * i] = hex_digits[src[i] >> 4];
+        dst[2 * i + 1] = hex_digits[src[i] & 0xf];
+    }
+}
+
+static size_t decode_scalar(uint8_t *dst, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint8_t hi = hex_value(src[2 * i]), lo = hex_value(src[2 * i + 1]);
+        if ((hi | lo) == 0xff) {
+            return i;
+        }
+        dst[i] = hi << 4 | lo;
+    }
+    return n;
+}
+
+#ifdef HEX_X86
+
+// SSE2 is part of x86-64, AVX2 is used where cpuid has it
+
+// nibbles to digits: n + '0', plus the gap to 'a' for n > 9
+static inline __m128i sse2_digits(__m128i n) {
+    __m128i gap = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), gap);
+}
+
+// 8 bytes to 16 digits
+static inline void sse2_encode8(uint8_t *dst, const uint8_t *src) {
+    __m128i b = _mm_loadl_epi64((const __m128i *) src);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), _mm_set1_epi8(0xf));
+    __m128i lo = _mm_and_si128(b, _mm_set1_epi8(0xf));
+    _mm_storeu_si128((__m128i *) dst, sse2_digits(_mm_unpacklo_epi8(hi, lo)));
+}
+
+// digits to nibbles, and a byte mask of the characters that are digits
+static inline __m128i sse2_values(__m128i c, __m128i *valid) {
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    // unsigned x < k as min(x, k - 1) == x
+    __m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+    *valid = _mm_or_si128(is_d, is_l);
+    __m128i alpha = _mm_add_epi8(l, _mm_set1_epi8(10));
+    return _mm_or_si128(_mm_and_si128(is_d, d), _mm_andnot_si128(is_d, alpha));
+}
+
+// 16 digits to 8 bytes, the count of leading pairs that were hex
+static inline size_t sse2_decode8(uint8_t *dst, const uint8_t *src) {
+    __m128i valid;
+    __m128i v = sse2_values(_mm_loadu_si128((const __m128i *) src), &valid);
+    // each 16-bit lane holds the high digit in its low byte
+    __m128i b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 4),
+                             _mm_srli_epi16(v, 8));
+    unsigned bad = ~_mm_movemask_epi8(valid) & 0xffff;
+    if (bad == 0) {
+        _mm_storel_epi64((__m128i *) dst, _mm_packus_epi16(b, b));
+        return 8;
+    }
+    size_t good = __builtin_ctz(bad) / 2;
+    uint8_t bytes[16];
+    _mm_storeu_si128((__m128i *) bytes, _mm_packus_epi16(b, b));
+    memcpy(dst, bytes, good);
+    return good;
+}
+
+__attribute__((target("avx2")))
+static void avx2_encode(uint8_t *dst, const uint8_t *src, size_t n) {
+    const __m256i mask = _mm256_set1_epi16(0xf);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i gap = _mm256_set1_epi8('a' - '0' - 10);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // a byte per 16-bit lane, its digits go to the lane's two bytes
+        __m256i w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + i)));
+        __m256i nib = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(w, 4), mask),
+                                      _mm256_slli_epi16(_mm256_and_si256(w, mask), 8));
+        __m256i c = _mm256_add_epi8(_mm256_add_epi8(nib, zero),
+                                    _mm256_and_si256(_mm256_cmpgt_epi8(nib, nine), gap));
+        _mm256_storeu_si256((__m256i *) (dst + 2 * i), c);
+    }
+    encode_scalar(dst + 2 * i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_decode(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i *) (src + 2 * i));
+        __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+        __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+        __m256i is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+        __m256i is_l = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+        if ((uint32_t) _mm256_movemask_epi8(_mm256_or_si256(is_d, is_l)) != 0xffffffffu) {
+            break;  // the pairs before the bad one go the scalar way
+        }
+        __m256i v = _mm256_or_si256(_mm256_and_si256(is_d, d),
+                                    _mm256_andnot_si256(is_d, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+        __m256i b = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xff)), 4),
+                                    _mm256_srli_epi16(v, 8));
+        // packing works per 128-bit lane, the low quadwords hold the bytes
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), 0x08);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm256_castsi256_si128(p));
+    }
+    return i + decode_scalar(dst + i, src + 2 * i, n - i);
+}
+
+static int use_avx2 = -1;
+
+static inline bool have_avx2() {
+    if (use_avx2 < 0) {
+        use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return use_avx2;
+}
+
+#endif
+
+void hex_encode_block(uint8_t *dst, const void *src, size_t n) {
+    const uint8_t *s = (const uint8_t *) src;
+#ifdef HEX_X86
+    if (n >= 16 && have_avx2()) {
+        avx2_encode(dst, s, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sse2_encode8(dst + 2 * i, s + i);
+    }
+    encode_scalar(dst + 2 * i, s + i, n - i);
+#else
+    encode_scalar(dst, s, n);
+#endif
+}
+
+size_t hex_decode_block(void *dst, const uint8_t *src, size_t n) {
+    uint8_t *d = (uint8_t *) dst;
+#ifdef HEX_X86
+    if (n >= 16 && have_avx2()) {
+        return avx2_decode(d, src, n);
+    }
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        size_t good = sse2_decode8(d + i, src + 2 * i);
+        if (good < 8) {
+            return i + good;
+        }
+    }
+    return i + decode_scalar(d + i, src + 2 * i, n - i);
+#else
+    return decode_scalar(d, src, n);
+#endif
+}
+
+uint64_t hex_decode_le64(const uint8_t *src, size_t len) {
+    uint8_t bytes[8] = {0};
+#ifdef HEX_X86
+    if (len >= 16) {
+        sse2_decode8(bytes, src);
+    } else
+#endif
+    {
+        decode_scalar(bytes, src, len / 2 < 8 ? len / 2 : 8);
+    }
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
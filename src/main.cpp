@@ -1,15 +1,42 @@
+#include <getopt.h>
 #include <iostream>
 #include <vector>
 #include <string>
 
 #include "common.h"
 #include "difftest.h"
+#include "options.h"
+#include "runner.h"
 
 uint64_t elf_entry = 0x80000000;
 
 
-int main() {
-    int result = difftest("testfile.elf");
+int main(int argc, char *argv[]) {
+    if (argc > 1 && !strcmp(argv[1], "--run")) {
+        return runner_main(argc - 1, argv + 1);
+    }
+
+    static const struct option options[] = {
+        {"help", no_argument, NULL, 'h'},
+        DIFFTEST_LONG_OPTIONS,
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h" DIFFTEST_SHORT_OPTIONS, options, NULL)) != -1) {
+        if (opt == 'h' || !difftest_option(opt, optarg)) {
+            eprintf("usage: %s [options] [ELF]\n"
+                    "       %s --run [options] ELF|GLOB|@LIST...\n"
+                    "without ELF, runs testfile.elf as linked by `make prepare`\n%s",
+                    argv[0], argv[0], difftest_options_help);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    const char *elf = optind < argc ? argv[optind] : "testfile.elf";
+    // cheap enough to always match the ELF, whatever left testfile.hex
+    runner_prepare_hex(elf);
+
+    int result = difftest(elf);
 
     return result;
-}
\ No newline at end of file
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "memcheck.h"
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE  (1UL << PAGE_SHIFT)
+#define PAGE_WORDS (PAGE_SIZE / 8)
+
+// the virt machine's DRAM as QEMU is started with it (-m 64M), stores
+// elsewhere are MMIO and not compared
+#define DRAM_BASE 0x80000000UL
+#define DRAM_SIZE (64UL << 20)
+
+// pages read from the reference at once
+#define READ_PAGES 16
+
+// differing bytes printed for a mismatch
+#define DIFF_BYTES 16
+
+typedef struct {
+    uint64_t data[PAGE_WORDS];
+    uint64_t mask[PAGE_WORDS];  // 0xff for every byte the DUT stored
+    bool dirty;
+} mem_page_t;
+
+static bool tracking;
+static uint64_t stores;
+static std::unordered_map<uint64_t, mem_page_t *> pages;
+// page numbers stored to since the last comparison
+static std::vector<uint64_t> dirty;
+
+static uint64_t byte_mask(uint8_t mask) {
+    uint64_t m = 0;
+    for (int i = 0; i < 8; i++) {
+        if (mask & (1 << i)) {
+            m |= 0xffUL << (8 * i);
+        }
+    }
+    return m;
+}
+
+extern "C" void difftest_store_commit(long long addr, long long data, char mask) {
+    uint64_t a = addr;
+    if (!tracking || a - DRAM_BASE >= DRAM_SIZE) {
+        return;
+    }
+    stores++;
+
+    uint64_t pn = a >> PAGE_SHIFT;
+    mem_page_t *&page = pages[pn];
+    if (page == NULL) {
+        page = (mem_page_t *) calloc(1, sizeof(mem_page_t));
+        assert(page != NULL);
+    }
+    if (!page->dirty) {
+        page->dirty = true;
+        dirty.push_back(pn);
+    }
+    uint64_t m = byte_mask(mask);
+    uint64_t *word = &page->data[(a & (PAGE_SIZE - 1)) / 8];
+    *word = (*word & ~m) | (data & m);
+    page->mask[(a & (PAGE_SIZE - 1)) / 8] |= m;
+}
+
+void memcheck_start() {
+    memcheck_stop();
+    tracking = true;
+}
+
+void memcheck_stop() {
+    tracking = false;
+    for (auto &p : pages) {
+        free(p.second);
+    }
+    pages.clear();
+    dirty.clear();
+    stores = 0;
+}
+
+uint64_t memcheck_stores() {
+    return stores;
+}
+
+// any stored byte that differs, branch-free so that the compiler
+// vectorizes it: the byte-by-byte search only runs when this hits
+static bool page_differs(const mem_page_t *page, const uint64_t *ref) {
+    uint64_t diff = 0;
+    for (size_t i = 0; i < PAGE_WORDS; i++) {
+        diff |= (page->data[i] ^ ref[i]) & page->mask[i];
+    }
+    return diff != 0;
+}
+
+static void page_print_diff(uint64_t pn, const mem_page_t *page, const uint64_t *ref) {
+    const uint8_t *dut = (const uint8_t *) page->data;
+    const uint8_t *mask = (const uint8_t *) page->mask;
+    const uint8_t *qemu = (const uint8_t *) ref;
+    int shown = 0;
+    for (size_t i = 0; i < PAGE_SIZE && shown < DIFF_BYTES; i++) {
+        if (mask[i] && dut[i] != qemu[i]) {
+            printf("memory 0x%016lx: DUT stored %02x, reference has %02x\n",
+                   (pn << PAGE_SHIFT) + i, dut[i], qemu[i]);
+            shown++;
+        }
+    }
+}
+
+bool memcheck_compare(ref_t *ref) {
+    if (!tracking || dirty.empty()) {
+        return true;
+    }
+
+    // runs of adjacent pages go in one read
+    std::sort(dirty.begin(), dirty.end());
+    static uint64_t buf[READ_PAGES * PAGE_WORDS];
+    bool ok = true;
+    for (size_t i = 0; i < dirty.size();) {
+        size_t n = 1;
+        while (i + n < dirty.size() && n < READ_PAGES && dirty[i + n] == dirty[i] + n) {
+            n++;
+        }
+        if (!ref_read_mem(ref, dirty[i] << PAGE_SHIFT, buf, n * PAGE_SIZE)) {
+            printf("The reference can't read its memory, memory isn't compared\n");
+            memcheck_stop();
+            return true;
+        }
+        for (size_t j = 0; j < n; j++) {
+            mem_page_t *page = pages[dirty[i + j]];
+            page->dirty = false;
+            if (page_differs(page, buf + j * PAGE_WORDS)) {
+                page_print_diff(dirty[i + j], page, buf + j * PAGE_WORDS);
+                ok = false;
+            }
+        }
+        i += n;
+    }
+    dirty.clear();
+    return ok;
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "difftest.h"
+#include "options.h"
+#include "prof.h"
+
+const char *difftest_options_help =
+    "  -c, --max-cycles N    DUT cycle budget, 0 = none (default: 0)\n"
+    "  -f, --full-every N    compare the full state every N commit groups, checking\n"
+    "                        only written registers in between, 0 = always (default: 0)\n"
+    "  -l, --lockstep N      run both sides about N instructions between comparisons,\n"
+    "                        replay a diverging interval commit by commit (default: 0)\n"
+    "  -P, --pipeline N      step the DUT on its own thread up to N commit groups\n"
+    "                        ahead of the comparisons, 0 = in step (default: 0)\n"
+    "  -M, --mem-check N     compare the memory the DUT stored to with the reference's\n"
+    "                        every N instructions and at the end, 0 = never (default: 0)\n"
+    "  -r, --ref LIB         reference model plugin (ref.h) instead of QEMU\n"
+    "  -W, --wave N          keep the last N cycles of waveform, written to\n"
+    "                        sim-window.vcd when a test fails (default: 0)\n"
+    "  -T, --trace WHEN      write sim.vcd/sim.fst from cycle:N, inst:N or pc:ADDR on,\n"
+    "                        +CYCLES appended limits its length\n"
+    "  -S, --sample EVERY    write the performance counters to samples.csv every\n"
+    "                        cycle:N or inst:N\n"
+    "      --phases LIST     tag the samples with NAME=LO-HI pc ranges, comma separated\n"
+    "  -G, --golden DIR      compare against a recorded trace of the reference in DIR\n"
+    "                        instead of running it, record one if there is none\n"
+    "      --ring PLUGIN     run QEMU freely with the TCG plugin PLUGIN streaming its\n"
+    "                        instructions, over GDB only where it has to\n"
+    "      --tcp             reach QEMU's gdbstub over loopback TCP, not a unix socket\n"
+    "      --no-diff         run the DUT alone, without a reference\n"
+    "      --commit-trace    print both sides after every instruction\n"
+    "      --ipc             print IPC and stall counters at the end\n"
+    "      --gdb-stats       print GDB transport statistics at the end\n"
+    "      --profile         print where the harness spends its time and the GDB\n"
+    "                        packet latencies at the end, or on SIGUSR2\n";
+
+bool difftest_option(int opt, const char *arg) {
+    switch (opt) {
+        case 'c': difftest_max_cycles = strtoull(arg, NULL, 0); break;
+        case 'f': difftest_full_interval = strtoull(arg, NULL, 0); break;
+        case 'l': difftest_lockstep_interval = strtoull(arg, NULL, 0); break;
+        case 'P': difftest_pipeline_depth = strtoull(arg, NULL, 0); break;
+        case 'M': difftest_mem_interval = strtoull(arg, NULL, 0); break;
+        case 'r':
+            // `--run` workers chdir into their own directories
+            difftest_ref_plugin = realpath(arg, NULL);
+            if (difftest_ref_plugin == NULL) {
+                panic("no such reference model: %s", arg);
+            }
+            break;
+        case 'W': difftest_wave_window = strtoull(arg, NULL, 0); break;
+        case 'T': difftest_wave_trigger = arg; break;
+        case 'S': difftest_sample_every = arg; break;
+        case OPT_PHASES: difftest_sample_phases = arg; break;
+        case 'G':
+            mkdir(arg, 0755);
+            difftest_golden_dir = realpath(arg, NULL);
+            if (difftest_golden_dir == NULL) {
+                panic("can't use %s for golden traces", arg);
+            }
+            break;
+        case OPT_RING:
+            difftest_ring_plugin = realpath(arg, NULL);
+            if (difftest_ring_plugin == NULL) {
+                panic("no such QEMU plugin: %s", arg);
+            }
+            break;
+        case OPT_TCP: difftest_gdb_tcp = true; break;
+        case OPT_NO_DIFF: difftest_no_diff = true; break;
+        case OPT_COMMIT_TRACE: difftest_commit_trace = true; break;
+        case OPT_IPC: difftest_ipc_stats = true; break;
+        case OPT_GDB_STATS: difftest_gdb_stats = true; break;
+        case OPT_PROFILE: prof_enabled = true; break;
+        default: return false;
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+
+#include "prof.h"
+
+// log2 buckets of the packet latency in ticks
+#define PROF_BUCKETS 64
+
+bool prof_enabled = false;
+
+static uint64_t section_ticks[PROF_SECTIONS];
+static uint64_t start_ticks;
+static struct timespec start_time;
+
+static struct {
+    uint64_t count;
+    uint64_t ticks;
+    uint64_t max;
+    uint64_t buckets[PROF_BUCKETS];
+} packets[256];
+
+static const char *section_names[PROF_SECTIONS] = {
+    "DUT eval + wave", "reference", "  hex decoding", "register compare",
+};
+
+void prof_add(int section, uint64_t ticks) {
+    section_ticks[section] += ticks;
+}
+
+void prof_packet(uint8_t type, uint64_t ticks) {
+    packets[type].count++;
+    packets[type].ticks += ticks;
+    if (ticks > packets[type].max) {
+        packets[type].max = ticks;
+    }
+    packets[type].buckets[ticks ? 63 - __builtin_clzll(ticks) : 0]++;
+}
+
+void prof_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    start_ticks = prof_ticks();
+}
+
+// the upper bound of the bucket holding the q-th fraction of the packets
+static uint64_t packet_quantile(int type, double q) {
+    uint64_t seen = 0;
+    for (int b = 0; b < PROF_BUCKETS; b++) {
+        seen += packets[type].buckets[b];
+        if (seen >= q * packets[type].count) {
+            return b == PROF_BUCKETS - 1 ? packets[type].max : (2UL << b) - 1;
+        }
+    }
+    return packets[type].max;
+}
+
+void prof_report(uint64_t instructions, uint64_t cycles) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ticks = prof_ticks() - start_ticks;
+    double seconds = (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+    if (ticks == 0 || seconds <= 0) {
+        return;
+    }
+    // the TSC is calibrated against the wall clock of the same span
+    double us_per_tick = seconds * 1e6 / ticks;
+
+    printf("[prof] %.3f s, %.0f instructions/s, %.0f cycles/s\n",
+           seconds, instructions / seconds, cycles / seconds);
+    uint64_t accounted = 0;
+    for (int i = 0; i < PROF_SECTIONS; i++) {
+        printf("[prof] %-18s %9.3f s %5.1f%%\n", section_names[i],
+               section_ticks[i] * us_per_tick / 1e6, 100.0 * section_ticks[i] / ticks);
+        if (i != PROF_HEX) {
+            accounted += section_ticks[i];
+        }
+    }
+    uint64_t other = ticks > accounted ? ticks - accounted : 0;
+    printf("[prof] %-18s %9.3f s %5.1f%%\n", "other",
+           other * us_per_tick / 1e6, 100.0 * other / ticks);
+
+    for (int type = 0; type < 256; type++) {
+        if (packets[type].count == 0) {
+            continue;
+        }
+        printf("[prof] packet '%c' %10lu sent, latency mean %.1f us, p50 < %.1f us, "
+               "p99 < %.1f us, max %.1f us\n",
+               type, packets[type].count, packets[type].ticks * us_per_tick / packets[type].count,
+               packet_quantile(type, 0.5) * us_per_tick, packet_quantile(type, 0.99) * us_per_tick,
+               packets[type].max * us_per_tick);
+    }
+}
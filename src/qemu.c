@@ -1,9 +1,15 @@
+#include <fcntl.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <unistd.h>
 
 #include "qemu.h"
+#include "elf_image.h"
+#include "hex_codec.h"
+#include "prof.h"
 
 /* only for debug, print the packets */
 #if 0
@@ -59,16 +65,125 @@ const int csr_num_list[csrs_count] = {
         0x18a,  // sip 
     };
 
+// gdbstub register numbers of the FPRs and CSRs, resolved from the target
+// description read by qemu_init(), indexed like qemu_regs_t.array - 33
+static int tdesc_regnum[32 + csrs_count];
+// register number of the next <reg> tag that has no `regnum` attribute,
+// the fpu feature follows the 33 core registers (x0-x31, pc)
+static int tdesc_next_regnum;
+
+// the full snapshot: one `g` for GPRs and pc, then one `p` per FPR and CSR
+#define SNAPSHOT_PACKETS (1 + 32 + csrs_count)
+static char snapshot_cmds[SNAPSHOT_PACKETS][16];
+static const uint8_t *snapshot_bufs[SNAPSHOT_PACKETS];
+static size_t snapshot_sizes[SNAPSHOT_PACKETS];
+
+// qemu_enable_int() let an interrupt through for the next step
+static bool int_armed;
+
+// QEMU answers binary `x` reads, -1 until a reply tells: an empty one, the
+// stub not knowing the packet, means no
+static int mem_binary = -1;
+
+// mtimecmp of hart 0 and mtime of the virt machine's CLINT
+#define CLINT_MTIMECMP 0x2004000UL
+#define CLINT_MTIME 0x200bff8UL
+
+// the virt machine's DRAM, as QEMU is started with it (-m 64M)
+#define DRAM_BASE 0x80000000UL
+#define DRAM_SIZE (64UL << 20)
+
+// QEMU's clock only advances with the instructions it executes, 1 ns each.
+// At the CLINT's 10 MHz that is a tick every 100 instructions: QEMU's timer
+// falls behind the DUT's, unless the DUT's mtime ticks even less often, and
+// doesn't fire first, nor while QEMU waits for the harness.
+#define QEMU_ICOUNT "shift=0,sleep=off"
+
+// give up on a continue that never reaches its breakpoint
+#define STEP_TIMEOUT_MS 2000
+
+// bytes per memory write, QEMU's gdbstub takes packets of up to 4 KiB and
+// hex doubles the data
+#define MEMCPY_CHUNK 1024
+// memory writes in flight at once
+#define MEMCPY_WINDOW 64
+
 int qemu_start(const char *elf, int port) {
     char remote_s[100];
     const char *exec = "qemu-system-riscv64";
     snprintf(remote_s, sizeof(remote_s), "tcp::%d", port);
 
-    execlp(exec, exec, "-S", "-gdb", remote_s, "-bios", elf, "-M", "virt", "-m", "64M", "-nographic", NULL);
+    execlp(exec, exec, "-S", "-gdb", remote_s, "-icount", QEMU_ICOUNT,
+           "-bios", elf, "-M", "virt", "-m", "64M", "-nographic", NULL);
+
+    return -1;
+}
+
+int qemu_start_fd(const char *elf, int listen_fd) {
+    char chardev_s[100];
+    const char *exec = "qemu-system-riscv64";
+    // the gdbstub accepts on the socket we already listen on
+    snprintf(chardev_s, sizeof(chardev_s), "socket,id=difftest-gdb,fd=%d,server=on,wait=off", listen_fd);
+
+    execlp(exec, exec, "-S", "-chardev", chardev_s, "-gdb", "chardev:difftest-gdb", "-icount", QEMU_ICOUNT,
+           "-bios", elf, "-M", "virt", "-m", "64M", "-nographic", NULL);
+
+    return -1;
+}
+
+int qemu_dram_create(char *name, size_t len) {
+    static int count;
+    snprintf(name, len, "/zjv2-dram-%d-%d", getpid(), count++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, DRAM_SIZE) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    return fd;
+}
+
+int qemu_start_pooled(const char *dram, int listen_fd) {
+    char chardev_s[100];
+    char backend_s[256];
+    const char *exec = "qemu-system-riscv64";
+    snprintf(chardev_s, sizeof(chardev_s), "socket,id=difftest-gdb,fd=%d,server=on,wait=off", listen_fd);
+    // shm_open() names live in /dev/shm
+    snprintf(backend_s, sizeof(backend_s),
+             "memory-backend-file,id=difftest-dram,size=%lu,mem-path=/dev/shm%s,share=on", DRAM_SIZE, dram);
+
+    execlp(exec, exec, "-S", "-chardev", chardev_s, "-gdb", "chardev:difftest-gdb", "-icount", QEMU_ICOUNT,
+           "-bios", "none", "-object", backend_s, "-M", "virt,memory-backend=difftest-dram", "-m", "64M",
+           "-nographic", NULL);
 
     return -1;
 }
 
+int qemu_start_ring(const char *elf, const char *plugin, const char *shm, uint64_t entry) {
+    char plugin_s[4096];
+    const char *exec = "qemu-system-riscv64";
+    snprintf(plugin_s, sizeof(plugin_s), "%s,shm=%s,entry=0x%lx", plugin, shm, entry);
+
+    execlp(exec, exec, "-plugin", plugin_s, "-bios", elf, "-M", "virt", "-m", "64M", "-nographic", NULL);
+
+    return -1;
+}
+
+qemu_conn_t *qemu_connect_fd(int listen_fd) {
+    // the listener exists before QEMU does, so this can't race its startup
+    qemu_conn_t *conn = gdb_begin_listener(listen_fd);
+    close(listen_fd);
+
+    if (strcmp(gdb_start_noack(conn), "OK") != 0) {
+        printf("QEMU refused no-ack mode, keep acknowledging packets\n");
+    }
+
+    return conn;
+}
+
 qemu_conn_t *qemu_connect(int port) {
     qemu_conn_t *conn = NULL;
     while (
@@ -76,88 +191,185 @@ qemu_conn_t *qemu_connect(int port) {
         usleep(1);
     }
 
+    // without ACKs every packet saves a flush on one side and a read on the other
+    if (strcmp(gdb_start_noack(conn), "OK") != 0) {
+        printf("QEMU refused no-ack mode, keep acknowledging packets\n");
+    }
+
     return conn;
 }
 
-// bool qemu_memcpy_to_qemu_small(qemu_conn_t *conn, uint32_t dest, void *src, int len) {
-//     char *buf = (char *) malloc(len * 2 + 128);
-//     assert(buf != NULL);
-//     int p = sprintf(buf, "M0x%x,%x:", dest, len);
-//     int i;
-//     for (i = 0; i < len; i++) {
-//         p += sprintf(buf + p, "%c%c",
-//                      hex_encode(((uint8_t *) src)[i] >> 4),
-//                      hex_encode(((uint8_t *) src)[i] & 0xf));
-//     }
-
-//     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
-//     free(buf);
-
-//     size_t size;
-//     uint8_t *reply = gdb_recv(conn, &size);
-//     bool ok = !strcmp((const char *) reply, "OK");
-//     free(reply);
-
-//     return ok;
-// }
-
-// bool qemu_memcpy_to_qemu(qemu_conn_t *conn, uint32_t dest, void *src, int len) {
-//     const int mtu = 1500;
-//     bool ok = true;
-//     while (len > mtu) {
-//         ok &= qemu_memcpy_to_qemu_small(conn, dest, src, mtu);
-//         dest += mtu;
-//         src += mtu;
-//         len -= mtu;
-//     }
-//     ok &= qemu_memcpy_to_qemu_small(conn, dest, src, len);
-//     return ok;
-// }
+void qemu_print_stats(qemu_conn_t *conn, uint64_t instructions) {
+    const struct gdb_stats *stats = gdb_get_stats(conn);
+    double n = instructions ? instructions : 1;
+
+    printf("GDB packets: %lu sent, %lu received, %lu bad checksums (%s mode)\n",
+           stats->packets_sent, stats->packets_recv, stats->bad_checksums,
+           gdb_acking(conn) ? "ack" : "no-ack");
+    printf("GDB per instruction: %.1f bytes sent, %.1f bytes received, %.2f write syscalls, %.2f read syscalls\n",
+           stats->bytes_sent / n, stats->bytes_recv / n, stats->flushes / n, stats->reads / n);
+    printf("no-ack saved per instruction: %.2f bytes, %.2f syscalls\n",
+           stats->acks_saved / n, stats->syscalls_saved / n);
+}
+
+bool qemu_memcpy_to_qemu(qemu_conn_t *conn, uint64_t dest, const void *src, size_t len) {
+    char *buf = (char *) malloc(MEMCPY_CHUNK * 2 + 64);
+    assert(buf != NULL);
+    const uint8_t *data = (const uint8_t *) src;
+    bool ok = true;
+
+    while (len > 0) {
+        // a window of writes per round trip
+        int n;
+        for (n = 0; n < MEMCPY_WINDOW && len > 0; n++) {
+            size_t chunk = len < MEMCPY_CHUNK ? len : MEMCPY_CHUNK;
+            int p = sprintf(buf, "M%lx,%zx:", dest, chunk);
+            if (data) {
+                hex_encode_block((uint8_t *) buf + p, data, chunk);
+            } else {
+                memset(buf + p, '0', 2 * chunk);
+            }
+            p += 2 * chunk;
+            gdb_post(conn, (const uint8_t *) buf, p);
+            dest += chunk;
+            data = data ? data + chunk : NULL;
+            len -= chunk;
+        }
+        for (int i = 0; i < n; i++) {
+            size_t size;
+            ok &= !strcmp((const char *) gdb_collect(conn, &size), "OK");
+        }
+    }
+
+    free(buf);
+    return ok;
+}
+
+bool qemu_memcpy_from_qemu(qemu_conn_t *conn, void *dest, uint64_t src, size_t len) {
+    uint8_t *out = (uint8_t *) dest;
+    size_t sizes[MEMCPY_WINDOW];
+
+    while (len > 0) {
+        // a lone request while it isn't known whether `x` works
+        bool binary = mem_binary != 0;
+        int window = mem_binary < 0 ? 1 : MEMCPY_WINDOW;
+        int n;
+        size_t off = 0;
+        for (n = 0; n < window && off < len; n++) {
+            size_t chunk = len - off < MEMCPY_CHUNK ? len - off : MEMCPY_CHUNK;
+            char buf[48];
+            int p = snprintf(buf, sizeof(buf), "%c%lx,%zx", binary ? 'x' : 'm', src + off, chunk);
+            gdb_post(conn, (const uint8_t *) buf, p);
+            sizes[n] = chunk;
+            off += chunk;
+        }
+
+        // the bytes that came in a row, up to the first short reply: the
+        // stub may answer less than asked, the rest is asked for again
+        size_t got = 0;
+        bool ok = true, whole = true, unsupported = false;
+        for (int i = 0; i < n; i++) {
+            size_t size;
+            uint8_t *reply = gdb_collect(conn, &size);
+            if (!whole) {
+                continue;
+            }
+            size_t m = 0;
+            if (binary && size == 0) {
+                unsupported = true;
+            } else if (binary) {
+                // 'b' and the bytes, unescaped by gdb_collect()
+                if (reply[0] == 'b') {
+                    m = size - 1 < sizes[i] ? size - 1 : sizes[i];
+                    memcpy(out + got, reply + 1, m);
+                }
+            } else {
+                m = hex_decode_block(out + got, reply, size / 2 < sizes[i] ? size / 2 : sizes[i]);
+            }
+            // nothing at all is an error reply (Enn), or `x` not understood
+            ok &= m > 0 || unsupported;
+            whole = m == sizes[i];
+            got += m;
+        }
+
+        if (unsupported) {
+            // no `x` in this QEMU, the rest in hex
+            mem_binary = 0;
+        } else if (!ok) {
+            return false;
+        } else if (binary) {
+            mem_binary = 1;
+        }
+        out += got;
+        src += got;
+        len -= got;
+    }
+    return true;
+}
 
 void qemu_getregs(qemu_conn_t *conn, qemu_regs_t *r) {
+    // request everything at once, the replies come back in request order
+    for (int i = 0; i < SNAPSHOT_PACKETS; i++) {
+        gdb_post(conn, snapshot_bufs[i], snapshot_sizes[i]);
+    }
+
     // read GPRs
-    gdb_send(conn, (const uint8_t *) "g", 1);
     size_t size;
-    uint8_t *reply = gdb_recv(conn, &size);
+    uint8_t *reply = gdb_collect(conn, &size);
 
     // printf("[DEBUG] check reply\n%s\n", reply);
 
-    uint8_t *p = reply;
-    uint8_t c;
-    for (int i = 0; i < 33; i++) {
-        c = p[16];
-        p[16] = '\0';
-        r->array[i] = gdb_decode_hex_str(p);
-        p[16] = c;
-        p += 16;
+    // GPRs and pc are 33 little-endian quadwords, decoded straight into
+    // the array
+    uint64_t t = PROF_BEGIN();
+    size_t n = size / 16 < 33 ? size / 16 : 33;
+    if (hex_decode_block(r->array, reply, n * 8) < n * 8) {
+        // unavailable registers read as 'x', the others still count
+        for (size_t i = 0; i < n; i++) {
+            r->array[i] = hex_decode_le64(reply + 16 * i, 16);
+        }
+    }
+    PROF_END(PROF_HEX, t);
+
+    // read FPRs and CSRs
+    for (int i = 33; i < regs_count; i++) {
+        reply = gdb_collect(conn, &size);
+        t = PROF_BEGIN();
+        r->array[i] = hex_decode_le64(reply, size);
+        PROF_END(PROF_HEX, t);
     }
-
-    free(reply);
-    qemu_getfprs(conn, r);
-    qemu_getcsrs(conn, r);
 }
 
-bool qemu_setregs(qemu_conn_t *conn, qemu_regs_t *r) {
-    int len = sizeof(qemu_regs_t);
-    char *buf = (char *) malloc(len * 2 + 128);
-    assert(buf != NULL);
-    buf[0] = 'G';
+void qemu_getregs_subset(qemu_conn_t *conn, qemu_regs_t *r, const int *idx, int n) {
+    // GPRs and pc by their own `p`, FPRs and CSRs reuse the snapshot packets
+    for (int i = 0; i < n; i++) {
+        if (idx[i] < 33) {
+            char buf[16];
+            int len = snprintf(buf, sizeof(buf), "p%x", idx[i]);
+            gdb_post(conn, (const uint8_t *) buf, len);
+        } else {
+            gdb_post(conn, snapshot_bufs[idx[i] - 32], snapshot_sizes[idx[i] - 32]);
+        }
+    }
 
-    void *src = r;
-    int p = 1;
-    for (int i = 0; i < len; i++) {
-        p += sprintf(buf + p, "%c%c",
-                     hex_encode(((uint8_t *) src)[i] >> 4),
-                     hex_encode(((uint8_t *) src)[i] & 0xf));
+    for (int i = 0; i < n; i++) {
+        size_t size;
+        uint8_t *reply = gdb_collect(conn, &size);
+        uint64_t t = PROF_BEGIN();
+        r->array[idx[i]] = hex_decode_le64(reply, size);
+        PROF_END(PROF_HEX, t);
     }
+}
 
-    gdb_send(conn, (const uint8_t *) buf, strlen(buf));
-    free(buf);
+bool qemu_setregs(qemu_conn_t *conn, qemu_regs_t *r) {
+    uint8_t buf[1 + 2 * sizeof(qemu_regs_t)];
+    buf[0] = 'G';
+    hex_encode_block(buf + 1, r, sizeof(qemu_regs_t));
+    gdb_send(conn, buf, sizeof(buf));
 
     size_t size;
     uint8_t *reply = gdb_recv(conn, &size);
     bool ok = !strcmp((const char *) reply, "OK");
-    free(reply);
 
     return ok;
 }
@@ -166,8 +378,91 @@ bool qemu_single_step(qemu_conn_t *conn) {
     char buf[] = "vCont;s:1";
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
     size_t size;
-    uint8_t *reply = gdb_recv(conn, &size);
-    free(reply);
+    gdb_recv(conn, &size);
+    return true;
+}
+
+// post a resume and wait for the target to stop again
+static bool qemu_resume(qemu_conn_t *conn, const char *cmd) {
+    size_t size;
+    gdb_post(conn, (const uint8_t *) cmd, strlen(cmd));
+    if (gdb_collect_timeout(conn, &size, STEP_TIMEOUT_MS) == NULL) {
+        gdb_interrupt(conn);
+        gdb_collect(conn, &size);
+        return false;
+    }
+    return true;
+}
+
+bool qemu_single_step_noint(qemu_conn_t *conn) {
+    int_armed = false;
+    return qemu_resume(conn, "vCont;s:1");
+}
+
+bool qemu_step_n(qemu_conn_t *conn, const uint64_t *pcs, int n) {
+    if (n == 0) {
+        return true;
+    }
+
+    // the last instruction of the group is a safe stop if the path up to it
+    // doesn't cross its pc, run there and step over it.  An interrupt let
+    // through by qemu_enable_int() only applies to the first step, so that
+    // group is stepped one by one.
+    uint64_t stop = pcs[n - 1];
+    bool direct = n > 2 && !int_armed;
+    for (int i = 0; direct && i < n - 1; i++) {
+        direct = pcs[i] != stop;
+    }
+
+    if (!direct) {
+        for (int i = 0; i < n; i++) {
+            if (!qemu_single_step_noint(conn)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "Z0,%016lx,4", stop);
+    gdb_post_discard(conn, (const uint8_t *) buf, strlen(buf));
+    bool reached = qemu_resume(conn, "vCont;c:1");
+    // removed either way, a pooled QEMU runs the next test with it
+    snprintf(buf, sizeof(buf), "z0,%016lx,4", stop);
+    gdb_post_discard(conn, (const uint8_t *) buf, strlen(buf));
+    if (!reached) {
+        printf("QEMU never reached pc 0x%016lx committed by the DUT\n", stop);
+        return false;
+    }
+    return qemu_resume(conn, "vCont;s:1");
+}
+
+bool qemu_run_to(qemu_conn_t *conn, uint64_t first, uint64_t stop, uint32_t hits) {
+    // step the first instruction by itself, it may sit on the breakpoint
+    // and then QEMU would stop there again without executing it
+    if (!qemu_single_step_noint(conn)) {
+        return false;
+    }
+    if (first == stop) {
+        hits--;
+    }
+
+    char set[32], clear[32];
+    snprintf(set, sizeof(set), "Z0,%016lx,4", stop);
+    snprintf(clear, sizeof(clear), "z0,%016lx,4", stop);
+    for (; hits > 0; hits--) {
+        gdb_post_discard(conn, (const uint8_t *) set, strlen(set));
+        bool reached = qemu_resume(conn, "vCont;c:1");
+        // step over the stop with the breakpoint out of the way
+        gdb_post_discard(conn, (const uint8_t *) clear, strlen(clear));
+        if (!reached) {
+            printf("QEMU ran off the DUT's path before pc 0x%016lx\n", stop);
+            return false;
+        }
+        if (!qemu_resume(conn, "vCont;s:1")) {
+            return false;
+        }
+    }
     return true;
 }
 
@@ -177,8 +472,7 @@ void qemu_break(qemu_conn_t *conn, uint64_t entry) {
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
 
     size_t size;
-    uint8_t *reply = gdb_recv(conn, &size);
-    free(reply);
+    gdb_recv(conn, &size);
 }
 
 void qemu_remove_breakpoint(qemu_conn_t *conn, uint64_t entry) {
@@ -187,16 +481,14 @@ void qemu_remove_breakpoint(qemu_conn_t *conn, uint64_t entry) {
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
 
     size_t size;
-    uint8_t *reply = gdb_recv(conn, &size);
-    free(reply);
+    gdb_recv(conn, &size);
 }
 
 void qemu_continue(qemu_conn_t *conn) {
     char buf[] = "vCont;c:1";
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
     size_t size;
-    uint8_t *reply = gdb_recv(conn, &size);
-    free(reply);
+    gdb_recv(conn, &size);
 }
 
 void qemu_disconnect(qemu_conn_t *conn) {
@@ -211,10 +503,11 @@ inst_t qemu_getinst(qemu_conn_t *conn, uint32_t pc) {
     size_t size;
     uint8_t *reply = gdb_recv(conn, &size);
 
-    reply[8] = '\0';
+    if (size > 8) {
+        reply[8] = '\0';
+    }
     inst_t inst = gdb_decode_inst(reply);
 
-    free(reply);
     return inst;
 }
 
@@ -224,19 +517,14 @@ bool qemu_setinst(qemu_conn_t *conn, uint32_t pc, inst_t *inst) {
 
     int p = snprintf(buf, sizeof(buf), "M%x,4:", pc); // 1+8+1+1+1 = 12
 
-    void *src = inst;
-    int i;
-    for (i = 0; i < len; i++) {
-        p += sprintf(buf + p, "%c%c",
-                     hex_encode(((uint8_t *) src)[i] >> 4),
-                     hex_encode(((uint8_t *) src)[i] & 0xf));
-    }
+    hex_encode_block((uint8_t *) buf + p, inst, len);
+    p += 2 * len;
+    buf[p] = '\0';
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
 
     size_t size;
     uint8_t *reply = gdb_recv(conn, &size);
     bool ok = !strcmp((const char *) reply, "OK");
-    free(reply);
 
     return ok;
 }
@@ -249,11 +537,12 @@ uint64_t qemu_getmem(qemu_conn_t *conn, uint32_t addr) {
     size_t size;
     uint8_t *reply = gdb_recv(conn, &size);
 
-    reply[8] = '\0';
+    if (size > 8) {
+        reply[8] = '\0';
+    }
     uint64_t content = gdb_decode_hex_str(reply);
     printf("0x%x: %08lx\n", addr, content);
 
-    free(reply);
     return content;
 }
 
@@ -265,13 +554,9 @@ bool qemu_setcsrs(qemu_conn_t *conn, int csr_num, uint64_t *data) {
     int p = snprintf(buf, sizeof(buf), "P%x=", csr_num); // 1+8+1+1+1 = 12
     printf("%s\n", buf);
 
-    void *src = data;
-    int i;
-    for (i = 0; i < len; i++) {
-        p += sprintf(buf + p, "%c%c",
-                     hex_encode(((uint8_t *) src)[i] >> 4),
-                     hex_encode(((uint8_t *) src)[i] & 0xf));
-    }
+    hex_encode_block((uint8_t *) buf + p, data, len);
+    p += 2 * len;
+    buf[p] = '\0';
     printf("%s\n", buf);
 
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
@@ -282,7 +567,6 @@ bool qemu_setcsrs(qemu_conn_t *conn, int csr_num, uint64_t *data) {
     bool ok = !strcmp((const char *) reply, "OK");
     printf("%s\n", (const char *) reply);
     assert(ok == true);
-    free(reply);
 
     return ok;
 }
@@ -291,16 +575,12 @@ bool qemu_set_csr(qemu_conn_t *conn, int csr_num, uint64_t *data) {
     int len = sizeof(uint64_t);
     char buf[2*4+128];
 
-    int p = snprintf(buf, sizeof(buf), "P%x=", csr_num_list[csr_num]); // 1+8+1+1+1 = 12
+    int p = snprintf(buf, sizeof(buf), "P%x=", tdesc_regnum[32 + csr_num]); // 1+8+1+1+1 = 12
     // printf("%s\n", buf);
 
-    void *src = data;
-    int i;
-    for (i = 0; i < len; i++) {
-        p += sprintf(buf + p, "%c%c",
-                     hex_encode(((uint8_t *) src)[i] >> 4),
-                     hex_encode(((uint8_t *) src)[i] & 0xf));
-    }
+    hex_encode_block((uint8_t *) buf + p, data, len);
+    p += 2 * len;
+    buf[p] = '\0';
     // printf("%s\n", buf);
 
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
@@ -311,7 +591,6 @@ bool qemu_set_csr(qemu_conn_t *conn, int csr_num, uint64_t *data) {
     bool ok = !strcmp((const char *) reply, "OK");
     // printf("%s\n", (const char *) reply);
     assert(ok == true);
-    free(reply);
 
     return ok;
 }
@@ -332,60 +611,271 @@ void qemu_getcsrs(qemu_conn_t *conn, qemu_regs_t *r) {
 
 void qemu_get_csr(qemu_conn_t *conn, int csr_num, uint64_t *csr_data) {
     char buf[32];
-    snprintf(buf, sizeof(buf), "p%x", csr_num_list[csr_num]);
+    snprintf(buf, sizeof(buf), "p%x", tdesc_regnum[32 + csr_num]);
     gdb_send(conn, (const uint8_t *) buf, strlen(buf));
     size_t size;
     uint8_t *reply = gdb_recv(conn, &size);
 
-    *csr_data = gdb_decode_hex_str(reply);
-    free(reply);
+    *csr_data = hex_decode_le64(reply, size);
 }
 
 void qemu_getfprs(qemu_conn_t *conn, qemu_regs_t *r) {
-    const int fpu_base = 33;
-
     for (int i = 0; i < 32; i++) {
         char buf[32];
-        snprintf(buf, sizeof(buf), "p%x", (fpu_base + i));
+        snprintf(buf, sizeof(buf), "p%x", tdesc_regnum[i]);
         gdb_send(conn, (const uint8_t *) buf, strlen(buf));
         size_t size;
         uint8_t *reply = gdb_recv(conn, &size);
 
-        r->array[33 + i] = gdb_decode_hex_str(reply);
+        r->array[33 + i] = hex_decode_le64(reply, size);
         // if (i == 1) {
         //     printf("[DEBUG] ft1 = %lx\n", r->array[33 + i]);
         // }
-        free(reply);
     }   
 }
 
+static bool tdesc_attr(const char *tag, const char *end, const char *attr,
+                       char *val, size_t len) {
+    size_t attr_len = strlen(attr);
+    for (const char *p = tag + 1; p + attr_len + 2 < end; p++) {
+        if (p[-1] == ' ' && !strncmp(p, attr, attr_len) &&
+            p[attr_len] == '=' && p[attr_len + 1] == '"') {
+            const char *v = p + attr_len + 2;
+            size_t i = 0;
+            while (v < end && *v != '"' && i + 1 < len) {
+                val[i++] = *v++;
+            }
+            val[i] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// pick the register numbers we snapshot out of a qXfer reply
+static void tdesc_parse(const char *xml) {
+    const char *tag = xml;
+    while ((tag = strstr(tag, "<reg ")) != NULL) {
+        const char *end = strchr(tag, '>');
+        if (end == NULL) {
+            break;  // the tag is cut at the end of this chunk
+        }
+
+        char name[32], num[16];
+        if (tdesc_attr(tag, end, "name", name, sizeof(name))) {
+            int regnum = tdesc_attr(tag, end, "regnum", num, sizeof(num)) ?
+                         (int) strtol(num, NULL, 10) : tdesc_next_regnum;
+            for (int i = 33; i < regs_count; i++) {
+                if (strcmp(name, regs_alias[i]) != 0) {
+                    continue;
+                }
+                // chunks overlap, keep the first sighting of a register
+                if (tdesc_regnum[i - 33] >= 0) {
+                    regnum = tdesc_regnum[i - 33];
+                }
+                tdesc_regnum[i - 33] = regnum;
+            }
+            tdesc_next_regnum = regnum + 1;
+        }
+        tag = end;
+    }
+}
+
+static void qemu_build_snapshot() {
+    // registers missing in the target description keep the numbering
+    // the gdbstub of qemu-system-riscv64 has always used
+    for (int i = 0; i < 32; i++) {
+        if (tdesc_regnum[i] < 0) {
+            tdesc_regnum[i] = 33 + i;
+        }
+    }
+    for (int i = 0; i < csrs_count; i++) {
+        if (tdesc_regnum[32 + i] < 0) {
+            tdesc_regnum[32 + i] = csr_num_list[i];
+        }
+    }
+
+    snprintf(snapshot_cmds[0], sizeof(snapshot_cmds[0]), "g");
+    for (int i = 0; i < 32 + csrs_count; i++) {
+        snprintf(snapshot_cmds[1 + i], sizeof(snapshot_cmds[0]), "p%x", tdesc_regnum[i]);
+    }
+    for (int i = 0; i < SNAPSHOT_PACKETS; i++) {
+        snapshot_bufs[i] = (const uint8_t *) snapshot_cmds[i];
+        snapshot_sizes[i] = strlen(snapshot_cmds[i]);
+    }
+}
+
 void qemu_init(qemu_conn_t *conn) {
     int init_cmds_count = sizeof(init_cmds) / sizeof(init_cmds[0]);
+
+    int_armed = false;
+    memset(tdesc_regnum, -1, sizeof(tdesc_regnum));
+    tdesc_next_regnum = 33;
     
     for (int i =0; i < init_cmds_count; i++) {
         gdb_send(conn, (const uint8_t *) init_cmds[i], strlen(init_cmds[i]));
         size_t size;
         uint8_t *reply = gdb_recv(conn, &size);
-        free(reply);
+        tdesc_parse((const char *) reply);
     }
+
+    qemu_build_snapshot();
 }
 
-void qemu_disable_int(qemu_conn_t *conn) {
-    const int mie_num = 3;
-    const uint64_t disable_mie_mtip = ~(1 << 7);
-    uint64_t *mie_data = (uint64_t *)malloc(sizeof(uint64_t));
-    qemu_get_csr(conn, mie_num, mie_data);
-    *mie_data &= disable_mie_mtip;
-    qemu_set_csr(conn, mie_num, mie_data);
-    free(mie_data);
+static void qemu_post_mtime(qemu_conn_t *conn, uint64_t mtime) {
+    char buf[64];
+    int p = snprintf(buf, sizeof(buf), "M%lx,8:", CLINT_MTIME);
+    hex_encode_block((uint8_t *) buf + p, &mtime, sizeof(mtime));
+    p += 2 * sizeof(mtime);
+    gdb_post_discard(conn, (const uint8_t *) buf, p);
 }
 
 void qemu_enable_int(qemu_conn_t *conn) {
-    const int mie_num = 3;
-    const uint64_t enable_mie_mtip = 1 << 7;
-    uint64_t *mie_data = (uint64_t *)malloc(sizeof(uint64_t));
-    qemu_get_csr(conn, mie_num, mie_data);
-    *mie_data |= enable_mie_mtip;
-    qemu_set_csr(conn, mie_num, mie_data);
-    free(mie_data);
-}
\ No newline at end of file
+    // The DUT's mtime reached mtimecmp, which the software wrote alike into
+    // both machines (mtime reads are MMIO, synced from the DUT).  QEMU's
+    // mtime goes up to mtimecmp and no further, which raises mip.MTIP for
+    // the next step but keeps QEMU's clock behind the DUT's, whatever rate
+    // the DUT's mtime runs at: the next mtimecmp the handler sets isn't
+    // reached early.  Posted, the write rides along with that step.
+    const uint64_t addrs[2] = { CLINT_MTIMECMP, CLINT_MTIME };
+    uint64_t values[2];
+    for (int i = 0; i < 2; i++) {
+        char buf[32];
+        int p = snprintf(buf, sizeof(buf), "m%lx,8", addrs[i]);
+        gdb_post(conn, (const uint8_t *) buf, p);
+    }
+    for (int i = 0; i < 2; i++) {
+        size_t size;
+        uint8_t *reply = gdb_collect(conn, &size);
+        values[i] = hex_decode_le64(reply, size);
+    }
+    if (values[0] > values[1]) {
+        qemu_post_mtime(conn, values[0]);
+    }
+    int_armed = true;
+}
+
+bool qemu_monitor(qemu_conn_t *conn, const char *cmd) {
+    char buf[256];
+    int p = snprintf(buf, sizeof(buf), "qRcmd,");
+    size_t len = strnlen(cmd, (sizeof(buf) - p) / 2);
+    hex_encode_block((uint8_t *) buf + p, cmd, len);
+    p += 2 * len;
+    gdb_send(conn, (const uint8_t *) buf, p);
+
+    // whatever the command prints comes first, as O packets
+    size_t size;
+    uint8_t *reply;
+    do {
+        reply = gdb_recv(conn, &size);
+    } while (reply[0] == 'O' && strcmp((const char *) reply, "OK") != 0);
+    return !strcmp((const char *) reply, "OK");
+}
+
+// bytes of the DRAM file read at once, and the unit zeroed or skipped
+#define DRAM_SCAN_CHUNK (64 << 10)
+#define DRAM_SCAN_PAGE  4096
+
+static bool all_zero(const uint8_t *p, size_t n) {
+    return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+// zero [addr, addr + len) of DRAM where the last tests left anything.  What
+// QEMU wrote is in the file at dram, only its pages that aren't zero are
+// written, through the gdbstub so that QEMU drops code it translated there.
+// Pages no test ever wrote are holes of the file and aren't even read.
+static bool qemu_zero_dirty(qemu_conn_t *conn, int dram, uint64_t addr, uint64_t len) {
+    static uint8_t buf[DRAM_SCAN_CHUNK];
+    off_t off = addr - DRAM_BASE, end = off + len;
+    while (off < end) {
+        off_t data = lseek(dram, off, SEEK_DATA);
+        if (data < 0 || data >= end) {
+            break;  // ENXIO: holes up to the end of the file
+        }
+        off_t hole = lseek(dram, data, SEEK_HOLE);
+        if (hole < 0 || hole > end) {
+            hole = end;
+        }
+
+        off_t dirty = -1;   // start of the dirty run
+        for (off = data; off < hole;) {
+            size_t n = hole - off < DRAM_SCAN_CHUNK ? hole - off : DRAM_SCAN_CHUNK;
+            if (pread(dram, buf, n, off) != (ssize_t) n) {
+                return false;
+            }
+            for (size_t i = 0; i < n; i += DRAM_SCAN_PAGE) {
+                size_t m = n - i < DRAM_SCAN_PAGE ? n - i : DRAM_SCAN_PAGE;
+                if (!all_zero(buf + i, m)) {
+                    dirty = dirty < 0 ? off + i : dirty;
+                } else if (dirty >= 0) {
+                    if (!qemu_memcpy_to_qemu(conn, DRAM_BASE + dirty, NULL, off + i - dirty)) {
+                        return false;
+                    }
+                    dirty = -1;
+                }
+            }
+            off += n;
+        }
+        if (dirty >= 0 && !qemu_memcpy_to_qemu(conn, DRAM_BASE + dirty, NULL, hole - dirty)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// zero the DRAM outside image's segments
+static bool qemu_zero_gaps(qemu_conn_t *conn, const elf_image_t *image, int dram) {
+    uint64_t addr = DRAM_BASE, end = DRAM_BASE + DRAM_SIZE;
+    while (addr < end) {
+        // the lowest segment not yet behind us, segments may come unordered
+        const elf_seg_t *next = NULL;
+        for (int i = 0; i < image->nsegs; i++) {
+            const elf_seg_t *seg = &image->segs[i];
+            if (seg->paddr + seg->memsz > addr && (next == NULL || seg->paddr < next->paddr)) {
+                next = seg;
+            }
+        }
+        uint64_t gap_end = next == NULL || next->paddr > end ? end : next->paddr;
+        if (gap_end > addr && !qemu_zero_dirty(conn, dram, addr, gap_end - addr)) {
+            return false;
+        }
+        if (next == NULL) {
+            break;
+        }
+        addr = next->paddr + next->memsz;
+    }
+    return true;
+}
+
+bool qemu_load_elf(qemu_conn_t *conn, int dram, const char *elf) {
+    elf_image_t *image = elf_image_open(elf);
+    if (image == NULL) {
+        return false;
+    }
+
+    // CPU, CSRs and devices back to their power-on state, the memory keeps
+    // what the last test left in it
+    if (!qemu_monitor(conn, "system_reset")) {
+        printf("QEMU refused system_reset\n");
+        elf_image_close(image);
+        return false;
+    }
+    int_armed = false;
+
+    bool ok = true;
+    for (int i = 0; ok && i < image->nsegs; i++) {
+        // the file part, then the zeroed rest (.bss)
+        const elf_seg_t *seg = &image->segs[i];
+        ok = qemu_memcpy_to_qemu(conn, seg->paddr, seg->data, seg->filesz) &&
+             qemu_memcpy_to_qemu(conn, seg->paddr + seg->filesz, NULL, seg->memsz - seg->filesz);
+    }
+    // and zeros everywhere else, as in a fresh QEMU and the DUT: a test
+    // reading memory it never wrote mustn't see the last test's stack
+    ok = ok && qemu_zero_gaps(conn, image, dram);
+    elf_image_close(image);
+
+    // mtime follows the virtual clock, which doesn't restart with the
+    // machine: start it from 0 as in a fresh QEMU
+    qemu_post_mtime(conn, 0);
+    return ok;
+}
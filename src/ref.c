@@ -0,0 +1,365 @@
+#include <dlfcn.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "golden.h"
+#include "prof.h"
+#include "ref.h"
+
+// QEMU's startup included, the first record comes after it
+#define RING_TIMEOUT_MS 5000
+
+struct ref {
+    qemu_conn_t *conn;      // QEMU backend
+    void *dl;               // plugin backend
+    ref_plugin_t plugin;
+    golden_t *golden;       // golden trace backend
+    ring_t *ring;           // free-running QEMU backend
+    bool pooled;            // conn is the caller's and stays open
+    qemu_regs_t shadow;     // its state, rebuilt from the records
+
+    golden_t *record;       // the QEMU or plugin run is recorded into
+    bool int_pending;       // ref_enable_int() applies to the next step
+    bool stale;             // the golden trace no longer applies
+    uint64_t steps;
+};
+
+static void *ref_sym(ref_t *ref, const char *so_path, const char *name) {
+    void *sym = dlsym(ref->dl, name);
+    if (sym == NULL) {
+        panic("%s doesn't export %s", so_path, name);
+    }
+    return sym;
+}
+
+ref_t *ref_open_qemu(int listen_fd, uint64_t entry) {
+    ref_t *ref = (ref_t *) calloc(1, sizeof(ref_t));
+    assert(ref != NULL);
+    ref->conn = qemu_connect_fd(listen_fd);
+    qemu_init(ref->conn);                       // 初始化 GDB，发送 qXfer 命令注册 features
+
+    qemu_regs_t regs = {0};
+    regs.pc = entry;
+    qemu_break(ref->conn, entry);
+    qemu_continue(ref->conn);
+    qemu_remove_breakpoint(ref->conn, entry);
+    qemu_setregs(ref->conn, &regs);
+    return ref;
+}
+
+ref_t *ref_open_pooled(qemu_conn_t *conn, int dram, const char *image, uint64_t entry) {
+    ref_t *ref = (ref_t *) calloc(1, sizeof(ref_t));
+    assert(ref != NULL);
+    ref->conn = conn;
+    ref->pooled = true;
+    if (!qemu_load_elf(conn, dram, image)) {
+        panic("can't load %s into QEMU", image);
+    }
+
+    // the reset vector only passes the hart id and the device tree in a0
+    // and a1 on its way to the image, nothing the zeroed GPRs keep
+    qemu_regs_t regs = {0};
+    regs.pc = entry;
+    qemu_setregs(conn, &regs);
+    return ref;
+}
+
+ref_t *ref_open_plugin(const char *so_path, const char *image, uint64_t entry) {
+    ref_t *ref = (ref_t *) calloc(1, sizeof(ref_t));
+    assert(ref != NULL);
+    // RTLD_DEEPBIND: the emulator is linked with --export-dynamic, its own
+    // symbols must not take the place of the plugin's
+    ref->dl = dlopen(so_path, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+    if (ref->dl == NULL) {
+        panic("can't load reference %s: %s", so_path, dlerror());
+    }
+
+    ref_plugin_t *p = &ref->plugin;
+    p->abi_version = (int (*)(void)) ref_sym(ref, so_path, "difftest_ref_abi_version");
+    p->init = (bool (*)(const char *, uint64_t)) ref_sym(ref, so_path, "difftest_ref_init");
+    p->exec = (void (*)(uint64_t)) ref_sym(ref, so_path, "difftest_ref_exec");
+    p->regcpy = (void (*)(qemu_regs_t *, int)) ref_sym(ref, so_path, "difftest_ref_regcpy");
+    p->mem = (void (*)(uint64_t, void *, size_t, int)) ref_sym(ref, so_path, "difftest_ref_memcpy");
+    p->raise_intr = (void (*)(uint64_t)) ref_sym(ref, so_path, "difftest_ref_raise_intr");
+
+    if (p->abi_version() != REF_ABI_VERSION) {
+        panic("%s implements reference ABI %d, not %d", so_path, p->abi_version(), REF_ABI_VERSION);
+    }
+    if (!p->init(image, entry)) {
+        panic("%s can't load %s", so_path, image);
+    }
+    return ref;
+}
+
+ref_t *ref_open_golden(golden_t *golden) {
+    ref_t *ref = (ref_t *) calloc(1, sizeof(ref_t));
+    assert(ref != NULL);
+    ref->golden = golden;
+    return ref;
+}
+
+ref_t *ref_open_ring(ring_t *ring, uint64_t entry) {
+    ref_t *ref = (ref_t *) calloc(1, sizeof(ref_t));
+    assert(ref != NULL);
+    ref->ring = ring;
+    ref->shadow.pc = entry;
+    return ref;
+}
+
+void ref_record(ref_t *ref, const char *path) {
+    qemu_regs_t regs = {0};
+    ref_getregs(ref, &regs);
+    ref->record = golden_create(path, &regs);
+}
+
+void ref_save_record(ref_t *ref) {
+    if (ref->record) {
+        golden_finish(ref->record, true);
+        ref->record = NULL;
+    }
+}
+
+bool ref_stale(ref_t *ref) {
+    return ref->stale;
+}
+
+void ref_close(ref_t *ref) {
+    if (ref->record) {
+        golden_finish(ref->record, false);
+    }
+    if (ref->pooled) {
+        // the next run's first reply must be its own
+        gdb_drain(ref->conn);
+    } else if (ref->conn) {
+        qemu_disconnect(ref->conn);
+    } else if (ref->dl) {
+        dlclose(ref->dl);
+    } else if (ref->golden) {
+        golden_close(ref->golden);
+    }
+    free(ref);
+}
+
+static bool golden_stale(ref_t *ref, const char *why) {
+    if (!ref->stale) {
+        printf("[golden] %s at instruction %lu, the trace doesn't apply to this run\n", why, ref->steps);
+        ref->stale = true;
+    }
+    return false;
+}
+
+static bool ring_stale(ref_t *ref, const char *why) {
+    if (!ref->stale) {
+        printf("[ring] %s at instruction %lu, QEMU has to be stepped over GDB\n", why, ref->steps);
+        ref->stale = true;
+    }
+    return false;
+}
+
+// apply the records of n instructions to the shadow state
+static bool ring_steps(ref_t *ref, uint64_t n) {
+    if (ref->stale) {
+        return false;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        const ring_rec_t *rec = ring_peek(ref->ring, RING_TIMEOUT_MS);
+        if (rec == NULL) {
+            return ring_stale(ref, "QEMU stopped");
+        }
+        // records of one instruction are published together
+        do {
+            if (!(rec->flags & RING_MORE)) {
+                ref->shadow.pc = rec->pc;
+            }
+            if (rec->reg) {
+                ref->shadow.array[rec->reg] = rec->value;
+            }
+            ring_pop(ref->ring);
+        } while ((rec = ring_peek(ref->ring, 0)) != NULL && rec->flags & RING_MORE);
+        ref->steps++;
+    }
+    return true;
+}
+
+// replay n instructions, an interrupt has to be taken exactly where the
+// recording took it
+static bool golden_steps(ref_t *ref, uint64_t n) {
+    if (ref->stale) {
+        return false;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        int flags;
+        if (!golden_next(ref->golden, &flags)) {
+            return golden_stale(ref, "end of the trace");
+        }
+        if (flags & GOLDEN_SYNC) {
+            return golden_stale(ref, "no MMIO read");
+        }
+        if (!(flags & GOLDEN_INT) != !ref->int_pending) {
+            return golden_stale(ref, ref->int_pending ? "interrupt not taken" : "no interrupt");
+        }
+        ref->int_pending = false;
+        ref->steps++;
+    }
+    return true;
+}
+
+// the register write of an MMIO sync has to be the recorded one
+static bool golden_sync(ref_t *ref, qemu_regs_t *r) {
+    int flags;
+    if (!golden_next(ref->golden, &flags) || !(flags & GOLDEN_SYNC)) {
+        return golden_stale(ref, "unexpected MMIO read");
+    }
+    if (memcmp(golden_state(ref->golden), r, sizeof(*r)) != 0) {
+        return golden_stale(ref, "different MMIO value");
+    }
+    return true;
+}
+
+// step the live backend one instruction at a time to record every state
+static bool record_steps(ref_t *ref, const uint64_t *pcs, int n) {
+    for (int i = 0; i < n; i++) {
+        if (ref->conn) {
+            if (!qemu_step_n(ref->conn, &pcs[i], 1)) {
+                return false;
+            }
+        } else {
+            ref->plugin.exec(1);
+        }
+        qemu_regs_t regs;
+        if (ref->conn) {
+            qemu_getregs(ref->conn, &regs);
+        } else {
+            ref->plugin.regcpy(&regs, REF_TO_DUT);
+        }
+        golden_append(ref->record, ref->int_pending ? GOLDEN_INT : 0, &regs);
+        ref->int_pending = false;
+    }
+    return true;
+}
+
+// everything below is accounted as PROF_REF
+
+void ref_getregs(ref_t *ref, qemu_regs_t *r) {
+    uint64_t t = PROF_BEGIN();
+    if (ref->golden) {
+        *r = *golden_state(ref->golden);
+    } else if (ref->ring) {
+        *r = ref->shadow;
+    } else if (ref->conn) {
+        qemu_getregs(ref->conn, r);
+    } else {
+        ref->plugin.regcpy(r, REF_TO_DUT);
+    }
+    PROF_END(PROF_REF, t);
+}
+
+bool ref_setregs(ref_t *ref, qemu_regs_t *r) {
+    uint64_t t = PROF_BEGIN();
+    bool ok = true;
+    if (ref->golden) {
+        ok = golden_sync(ref, r);
+    } else if (ref->ring) {
+        // QEMU read its own device, the DUT has to have read the same
+        if (memcmp(&ref->shadow, r, sizeof(*r)) != 0) {
+            ok = ring_stale(ref, "different MMIO value");
+        }
+    } else if (ref->conn) {
+        ok = qemu_setregs(ref->conn, r);
+    } else {
+        ref->plugin.regcpy(r, REF_TO_REF);
+    }
+    if (ref->record) {
+        golden_append(ref->record, GOLDEN_SYNC, r);
+    }
+    PROF_END(PROF_REF, t);
+    return ok;
+}
+
+void ref_getregs_subset(ref_t *ref, qemu_regs_t *r, const int *idx, int n) {
+    uint64_t t = PROF_BEGIN();
+    if (ref->golden) {
+        *r = *golden_state(ref->golden);
+    } else if (ref->ring) {
+        *r = ref->shadow;
+    } else if (ref->conn) {
+        qemu_getregs_subset(ref->conn, r, idx, n);
+    } else {
+        // a copy of the whole struct is cheaper than picking registers
+        ref->plugin.regcpy(r, REF_TO_DUT);
+    }
+    PROF_END(PROF_REF, t);
+}
+
+bool ref_step_n(ref_t *ref, const uint64_t *pcs, int n) {
+    uint64_t t = PROF_BEGIN();
+    bool ok = true;
+    if (ref->golden) {
+        ok = golden_steps(ref, n);
+    } else if (ref->ring) {
+        ok = ring_steps(ref, n);
+    } else if (ref->record) {
+        ok = record_steps(ref, pcs, n);
+    } else if (ref->conn) {
+        ok = qemu_step_n(ref->conn, pcs, n);
+    } else {
+        ref->plugin.exec(n);
+    }
+    PROF_END(PROF_REF, t);
+    return ok;
+}
+
+bool ref_run_to(ref_t *ref, uint64_t first, uint64_t stop, uint32_t hits, uint64_t count) {
+    uint64_t t = PROF_BEGIN();
+    bool ok = true;
+    assert(ref->record == NULL);    // difftest_body() records commit by commit
+    if (ref->golden) {
+        ok = golden_steps(ref, count);
+    } else if (ref->ring) {
+        ok = ring_steps(ref, count);
+    } else if (ref->conn) {
+        ok = qemu_run_to(ref->conn, first, stop, hits);
+    } else {
+        ref->plugin.exec(count);
+    }
+    PROF_END(PROF_REF, t);
+    return ok;
+}
+
+void ref_enable_int(ref_t *ref) {
+    uint64_t t = PROF_BEGIN();
+    ref->int_pending = true;
+    if (ref->golden) {
+        // checked by the next step
+    } else if (ref->ring) {
+        // QEMU runs ahead, it can't be steered into the DUT's interrupt
+        ring_stale(ref, "interrupt");
+    } else if (ref->conn) {
+        qemu_enable_int(ref->conn);
+    } else {
+        ref->plugin.raise_intr(MIP_MTIP_CAUSE);
+    }
+    PROF_END(PROF_REF, t);
+}
+
+void ref_print_stats(ref_t *ref, uint64_t instructions) {
+    if (ref->conn) {
+        qemu_print_stats(ref->conn, instructions);
+    }
+}
+
+bool ref_read_mem(ref_t *ref, uint64_t addr, void *buf, size_t len) {
+    if (ref->conn) {
+        return qemu_memcpy_from_qemu(ref->conn, buf, addr, len);
+    }
+    if (ref->dl) {
+        ref->plugin.mem(addr, buf, len, REF_TO_DUT);
+        return true;
+    }
+    // a golden trace or the ring has registers only
+    return false;
+}
+
+uint64_t ref_packets(ref_t *ref) {
+    return ref->conn ? gdb_get_stats(ref->conn)->packets_sent : 0;
+}
@@ -0,0 +1,68 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ring.h"
+
+// polls of an empty ring between two looks at the clock
+#define RING_SPINS 4096
+
+ring_t *ring_create(char *name, size_t len, uint64_t entry) {
+    snprintf(name, len, "/zjv2-difftest-%d", getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        panic("can't create shared memory %s", name);
+    }
+    if (ftruncate(fd, sizeof(ring_t)) != 0) {
+        panic("can't size shared memory %s", name);
+    }
+    ring_t *ring = (ring_t *) mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        panic("can't map shared memory %s", name);
+    }
+    ring->entry = entry;
+    ring->head = 0;
+    ring->tail = 0;
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+void ring_destroy(ring_t *ring, const char *name) {
+    munmap(ring, sizeof(ring_t));
+    shm_unlink(name);
+}
+
+static uint64_t ring_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+const ring_rec_t *ring_peek(ring_t *ring, int timeout_ms) {
+    uint64_t tail = ring->tail;
+    uint64_t deadline = 0;
+    for (int spins = 0; __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail; spins++) {
+        if (timeout_ms == 0) {
+            return NULL;
+        }
+        if (spins % RING_SPINS == RING_SPINS - 1) {
+            uint64_t now = ring_ms();
+            if (deadline == 0) {
+                deadline = now + timeout_ms;
+            } else if (now >= deadline) {
+                return NULL;
+            }
+            sched_yield();
+        }
+    }
+    return &ring->recs[tail % RING_RECORDS];
+}
+
+void ring_pop(ring_t *ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
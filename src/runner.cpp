@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <getopt.h>
+#include <glob.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "difftest.h"
+#include "elf_image.h"
+#include "gdb_proto.h"
+#include "options.h"
+#include "runner.h"
+
+#define ANSI_CYAN "\033[0;36m"
+#define ANSI_NONE "\033[0m"
+
+// what a worker leaves in its directory for the summary
+#define RUNNER_STATS_FILE "stats"
+
+typedef struct {
+    std::string elf;      // absolute path
+    std::string name;     // of the directory, the key into a baseline
+    std::string dir;      // private working directory
+    pid_t pid;
+    int slot;             // of the QEMU pool
+    double start;
+    double seconds;
+    int status;           // from waitpid()
+    difftest_stats_t stats;
+} runner_test_t;
+
+// --pool: a QEMU per worker slot, reloaded with each test it runs
+typedef struct {
+    struct gdb_conn *conn;  // NULL until started, or after it was dropped
+    pid_t pid;
+    int dram;               // its DRAM, valid with conn
+    bool busy;
+} runner_qemu_t;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+    eprintf("usage: %s --run [options] ELF|GLOB|@LIST...\n"
+            "  -j, --jobs N          parallel workers (default: online CPUs)\n"
+            "  -t, --timeout SEC     wall-clock budget per test, 0 = none (default: 600)\n"
+            "  -w, --workdir DIR     parent of the per-test directories (default: run)\n"
+            "  -o, --summary FILE    JSON summary (default: <workdir>/summary.json)\n"
+            "  -b, --baseline FILE   compare the simulation speed of every test with the\n"
+            "                        one in this earlier summary\n"
+            "  -s, --max-slowdown P  fail if a test got more than P%% slower (default: 10)\n"
+            "  -p, --pool            keep a QEMU per worker and reload it with each test\n"
+            "                        instead of starting one per test\n"
+            "per test:\n%s",
+            prog, difftest_options_help);
+}
+
+static void add_elfs(std::vector<std::string> &elfs, const char *arg) {
+    // @file: one ELF or glob per line
+    if (arg[0] == '@') {
+        FILE *fp = fopen(arg + 1, "r");
+        if (fp == NULL) {
+            panic("can't open list %s", arg + 1);
+        }
+        char line[4096];
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0' && line[0] != '#') {
+                add_elfs(elfs, line);
+            }
+        }
+        fclose(fp);
+        return;
+    }
+
+    // quoted globs are expanded here, anything else is taken as is
+    glob_t g;
+    if (glob(arg, GLOB_NOCHECK, NULL, &g) != 0) {
+        panic("bad pattern %s", arg);
+    }
+    for (size_t i = 0; i < g.gl_pathc; i++) {
+        char *path = realpath(g.gl_pathv[i], NULL);
+        if (path == NULL) {
+            panic("no such ELF: %s", g.gl_pathv[i]);
+        }
+        elfs.push_back(path);
+        free(path);
+    }
+    globfree(&g);
+}
+
+// the DUT loads testfile.hex from its working directory
+void runner_prepare_hex(const char *elf) {
+    elf_image_t *image = elf_image_open(elf);
+    if (image == NULL || !elf_image_write_hex(image, "testfile.hex")) {
+        panic("prepare failed: %s", elf);
+    }
+    elf_image_close(image);
+}
+
+static void runner_prepare(const runner_test_t &test) {
+    runner_prepare_hex(test.elf.c_str());
+    if (symlink(test.elf.c_str(), "testfile.elf") != 0 && errno != EEXIST) {
+        panic("symlink testfile.elf");
+    }
+}
+
+// the difftest_* knobs were set by runner_main() before the fork
+static void runner_worker(const runner_test_t &test, unsigned timeout) {
+    if (chdir(test.dir.c_str()) != 0) {
+        panic("chdir %s", test.dir.c_str());
+    }
+
+    FILE *log = freopen("difftest.log", "w", stdout);
+    if (log == NULL || dup2(fileno(stdout), 2) < 0) {
+        panic("can't redirect the output of %s", test.elf.c_str());
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // SIGALRM is not handled, the run and its QEMU (PDEATHSIG) just die.
+    // A pooled QEMU is dropped by runner_main() instead.
+    alarm(timeout);
+    runner_prepare(test);
+
+    fflush(stdout);
+    int result = difftest(test.elf.c_str());
+
+    FILE *fp = fopen(RUNNER_STATS_FILE, "w");
+    if (fp != NULL) {
+        fprintf(fp, "%lu %lu %lu %d\n", difftest_stats.instructions, difftest_stats.cycles,
+                difftest_stats.ref_packets, difftest_stats.qemu_idle);
+        fclose(fp);
+    }
+    fflush(stdout);
+    _exit(result);
+}
+
+// empty when the worker died before writing them
+static void runner_read_stats(runner_test_t &test) {
+    test.stats = difftest_stats_t();
+    FILE *fp = fopen((test.dir + "/" RUNNER_STATS_FILE).c_str(), "r");
+    if (fp == NULL) {
+        return;
+    }
+    int idle;
+    if (fscanf(fp, "%lu %lu %lu %d", &test.stats.instructions, &test.stats.cycles,
+               &test.stats.ref_packets, &idle) != 4) {
+        test.stats = difftest_stats_t();
+    } else {
+        test.stats.qemu_idle = idle;
+    }
+    fclose(fp);
+}
+
+// a QEMU for the slot, started the first time it is needed
+static void runner_pool_take(runner_qemu_t &q, const std::string &log) {
+    if (q.conn == NULL) {
+        q.conn = difftest_start_pooled(log.c_str(), &q.pid, &q.dram);
+    }
+    q.busy = true;
+    difftest_qemu = q.conn;
+    difftest_qemu_dram = q.dram;
+}
+
+// a QEMU left in an unknown state, or that died, is replaced on next use
+static void runner_pool_drop(runner_qemu_t &q) {
+    if (q.conn == NULL) {
+        return;
+    }
+    if (q.pid > 0) {
+        kill(q.pid, SIGTERM);
+        waitpid(q.pid, NULL, 0);
+    }
+    gdb_end(q.conn);
+    close(q.dram);
+    q.conn = NULL;
+    q.pid = 0;
+}
+
+static double runner_khz(const runner_test_t &test) {
+    return test.seconds > 0 ? test.stats.cycles / test.seconds / 1000 : 0;
+}
+
+static const char *runner_status(int status) {
+    if (WIFSIGNALED(status)) {
+        return WTERMSIG(status) == SIGALRM ? "timeout" : "crash";
+    }
+    switch (WEXITSTATUS(status)) {
+        case 0: return "pass";
+        case 1: return "fail";
+        case DIFFTEST_CYCLE_BUDGET: return "cycles";
+        default: return "error";
+    }
+}
+
+static void json_string(FILE *fp, const std::string &s) {
+    fputc('"', fp);
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+        }
+        fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void runner_summary(const char *path, const std::vector<runner_test_t> &tests, double seconds) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        panic("can't write %s", path);
+    }
+
+    int passed = 0;
+    for (const runner_test_t &test : tests) {
+        passed += !strcmp(runner_status(test.status), "pass");
+    }
+
+    fprintf(fp, "{\n  \"total\": %zu,\n  \"passed\": %d,\n  \"failed\": %zu,\n  \"seconds\": %.3f,\n  \"tests\": [\n",
+            tests.size(), passed, tests.size() - passed, seconds);
+    for (size_t i = 0; i < tests.size(); i++) {
+        const runner_test_t &test = tests[i];
+        // one test per line, runner_read_baseline() depends on it
+        fprintf(fp, "    {\"name\": ");
+        json_string(fp, test.name);
+        fprintf(fp, ", \"elf\": ");
+        json_string(fp, test.elf);
+        fprintf(fp, ", \"status\": \"%s\", \"exit\": %d, \"seconds\": %.3f, "
+                    "\"instructions\": %lu, \"cycles\": %lu, \"sim_khz\": %.3f, \"ref_packets\": %lu, "
+                    "\"log\": ",
+                runner_status(test.status),
+                WIFEXITED(test.status) ? WEXITSTATUS(test.status) : -WTERMSIG(test.status),
+                test.seconds, test.stats.instructions, test.stats.cycles, runner_khz(test),
+                test.stats.ref_packets);
+        json_string(fp, test.dir + "/difftest.log");
+        fprintf(fp, "}%s\n", i + 1 < tests.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+// sim_khz by name from a summary written by runner_summary()
+static std::map<std::string, double> runner_read_baseline(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        panic("can't open baseline %s", path);
+    }
+    std::map<std::string, double> khz;
+    char line[8192];
+    while (fgets(line, sizeof(line), fp)) {
+        const char *name = strstr(line, "{\"name\": \"");
+        const char *sim = strstr(line, "\"sim_khz\": ");
+        if (name == NULL || sim == NULL) {
+            continue;
+        }
+        name += strlen("{\"name\": \"");
+        khz[std::string(name, strcspn(name, "\""))] = strtod(sim + strlen("\"sim_khz\": "), NULL);
+    }
+    fclose(fp);
+    return khz;
+}
+
+// print the speed of every passing test next to its baseline, the number of
+// tests that got slower than max_slowdown percent
+static int runner_compare(const std::vector<runner_test_t> &tests, const char *path, double max_slowdown) {
+    std::map<std::string, double> baseline = runner_read_baseline(path);
+    int regressions = 0;
+    printf("%-40s %12s %12s %8s\n", "test", "kHz", "baseline", "change");
+    for (const runner_test_t &test : tests) {
+        auto base = baseline.find(test.name);
+        if (base == baseline.end() || base->second <= 0 || strcmp(runner_status(test.status), "pass")) {
+            continue;
+        }
+        double khz = runner_khz(test);
+        double change = 100 * (khz - base->second) / base->second;
+        bool slower = change < -max_slowdown;
+        regressions += slower;
+        printf("%-40s %12.3f %12.3f %+7.1f%%%s\n", test.name.c_str(), khz, base->second, change,
+               slower ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int runner_main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"jobs",         required_argument, NULL, 'j'},
+        {"timeout",      required_argument, NULL, 't'},
+        {"workdir",      required_argument, NULL, 'w'},
+        {"summary",      required_argument, NULL, 'o'},
+        {"baseline",     required_argument, NULL, 'b'},
+        {"max-slowdown", required_argument, NULL, 's'},
+        {"pool",         no_argument,       NULL, 'p'},
+        {"help",         no_argument,       NULL, 'h'},
+        DIFFTEST_LONG_OPTIONS,
+        {NULL, 0, NULL, 0},
+    };
+
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned timeout = 600;
+    std::string workdir = "run";
+    std::string summary;
+    const char *baseline = NULL;
+    double max_slowdown = 10;
+    bool pool = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:t:w:o:b:s:ph" DIFFTEST_SHORT_OPTIONS, options, NULL)) != -1) {
+        switch (opt) {
+            case 'j': jobs = strtol(optarg, NULL, 0); break;
+            case 't': timeout = strtoul(optarg, NULL, 0); break;
+            case 'w': workdir = optarg; break;
+            case 'o': summary = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 's': max_slowdown = strtod(optarg, NULL); break;
+            case 'p': pool = true; break;
+            default:
+                if (!difftest_option(opt, optarg)) {
+                    usage(argv[0]);
+                    return opt == 'h' ? 0 : 1;
+                }
+                break;
+        }
+    }
+
+    std::vector<std::string> elfs;
+    for (int i = optind; i < argc; i++) {
+        add_elfs(elfs, argv[i]);
+    }
+    if (elfs.empty() || jobs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (summary.empty()) {
+        summary = workdir + "/summary.json";
+    }
+
+    mkdir(workdir.c_str(), 0755);
+    std::vector<runner_test_t> tests(elfs.size());
+    std::set<std::string> dirs;
+    for (size_t i = 0; i < elfs.size(); i++) {
+        std::string name = elfs[i].substr(elfs[i].rfind('/') + 1);
+        std::string dir = workdir + "/" + name;
+        for (int n = 1; !dirs.insert(dir).second; n++) {
+            dir = workdir + "/" + name + "-" + std::to_string(n);
+        }
+        mkdir(dir.c_str(), 0755);
+        tests[i].elf = elfs[i];
+        tests[i].name = dir.substr(workdir.size() + 1);
+        tests[i].dir = dir;
+    }
+
+    // only QEMU over GDB can be reloaded
+    pool = pool && !difftest_ref_plugin && !difftest_no_diff;
+    std::vector<runner_qemu_t> qemus(pool ? jobs : 0);
+
+    printf("Running %zu tests on %ld workers%s\n", tests.size(), jobs, pool ? " with a QEMU each" : "");
+    fflush(stdout);
+
+    double start = now_s();
+    size_t next = 0, running = 0, done = 0;
+    while (done < tests.size()) {
+        while (running < (size_t) jobs && next < tests.size()) {
+            runner_test_t &test = tests[next++];
+            test.slot = -1;
+            for (size_t i = 0; i < qemus.size() && test.slot < 0; i++) {
+                if (!qemus[i].busy) {
+                    test.slot = i;
+                    runner_pool_take(qemus[i], workdir + "/qemu-" + std::to_string(i) + ".log");
+                }
+            }
+            // a worker that doesn't get to write its stats mustn't be
+            // credited with those of an earlier run in the same workdir
+            unlink((test.dir + "/" RUNNER_STATS_FILE).c_str());
+            test.start = now_s();
+            test.pid = fork();
+            if (test.pid < 0) {
+                panic("fork");
+            }
+            if (test.pid == 0) {
+                runner_worker(test, timeout);
+            }
+            running++;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic("waitpid");
+        }
+        for (runner_qemu_t &q : qemus) {
+            if (q.pid == pid) {
+                // its worker, if any, fails on its own
+                q.pid = 0;
+                runner_pool_drop(q);
+            }
+        }
+        for (runner_test_t &test : tests) {
+            if (test.pid != pid) {
+                continue;
+            }
+            test.status = status;
+            test.seconds = now_s() - test.start;
+            runner_read_stats(test);
+            if (test.slot >= 0) {
+                // a worker that died or timed out may have left QEMU running
+                // or its replies unread
+                if (!WIFEXITED(status) || !test.stats.qemu_idle) {
+                    runner_pool_drop(qemus[test.slot]);
+                }
+                qemus[test.slot].busy = false;
+            }
+            running--;
+            done++;
+            printf("[%zu/%zu] " ANSI_CYAN "%s" ANSI_NONE ": %s (%.2fs)\n", done, tests.size(),
+                   test.name.c_str(), runner_status(status), test.seconds);
+            fflush(stdout);
+            break;
+        }
+    }
+
+    for (runner_qemu_t &q : qemus) {
+        runner_pool_drop(q);
+    }
+    runner_summary(summary.c_str(), tests, now_s() - start);
+
+    int failed = 0;
+    for (const runner_test_t &test : tests) {
+        failed += strcmp(runner_status(test.status), "pass") != 0;
+    }
+    printf("%zu passed, %d failed, summary in %s\n", tests.size() - failed, failed, summary.c_str());
+
+    int regressions = baseline ? runner_compare(tests, baseline, max_slowdown) : 0;
+    if (regressions) {
+        printf("%d tests more than %.1f%% slower than %s\n", regressions, max_slowdown, baseline);
+    }
+    return failed != 0 || regressions != 0;
+}
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "common.h"
+#include "sampler.h"
+
+#define SAMPLER_FILE "samples.csv"
+
+Sampler::~Sampler() {
+    record(last);
+    fclose(fp);
+    printf("[sampler] counters every %lu %s in %s\n", every, by_inst ? "instructions" : "cycles",
+           SAMPLER_FILE);
+}
+
+// close the running phase with a row as of the commit before, which is
+// still in it, and find the one pc is in, or the gap between two phases it
+// falls into
+void Sampler::enter_phase(uint64_t pc) {
+    if (last.instructions != recorded) {
+        record(last);
+    }
+    phase = "-";
+    phase_lo = 0;
+    phase_hi = UINT64_MAX;
+    for (const sampler_phase_t &p : phases) {
+        if (pc < p.lo) {
+            phase_hi = p.lo;
+            break;
+        }
+        if (pc < p.hi) {
+            phase = p.name.c_str();
+            phase_lo = p.lo;
+            phase_hi = p.hi;
+            break;
+        }
+        phase_lo = p.hi;
+    }
+}
+
+// the counters are cumulative, per phase figures are the difference between
+// a row and the one before
+void Sampler::record(const sampler_row_t &row) {
+    recorded = row.instructions;
+    fprintf(fp, "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%s\n", row.cycle, row.instructions, row.counter,
+            row.common, row.dstall, row.istall, row.mdu_stall, phase);
+}
+
+Sampler *sampler_open(VTileForVerilator *dut, VerilatedContext *context,
+                      const char *every, const char *phases) {
+    Sampler *s = new Sampler;
+    s->dut = dut;
+    s->context = context;
+    if (!strncmp(every, "cycle:", 6)) {
+        s->by_inst = false;
+        s->every = strtoull(every + 6, NULL, 0);
+    } else if (!strncmp(every, "inst:", 5)) {
+        s->by_inst = true;
+        s->every = strtoull(every + 5, NULL, 0);
+    } else {
+        panic("bad sampling interval %s", every);
+    }
+    if (s->every == 0) {
+        panic("bad sampling interval %s", every);
+    }
+    s->next = s->every;
+
+    for (const char *p = phases; p && *p; ) {
+        const char *eq = strchr(p, '=');
+        if (eq == NULL) {
+            panic("bad phase %s", p);
+        }
+        sampler_phase_t phase;
+        phase.name.assign(p, eq - p);
+        char *end;
+        phase.lo = strtoull(eq + 1, &end, 0);
+        if (*end != '-') {
+            panic("bad phase %s", p);
+        }
+        phase.hi = strtoull(end + 1, &end, 0);
+        if (phase.hi <= phase.lo || (*end != ',' && *end != '\0')) {
+            panic("bad phase %s", p);
+        }
+        s->phases.push_back(phase);
+        p = *end ? end + 1 : end;
+    }
+    std::sort(s->phases.begin(), s->phases.end(),
+              [](const sampler_phase_t &a, const sampler_phase_t &b) { return a.lo < b.lo; });
+    for (size_t i = 1; i < s->phases.size(); i++) {
+        if (s->phases[i].lo < s->phases[i - 1].hi) {
+            panic("phases %s and %s overlap", s->phases[i - 1].name.c_str(), s->phases[i].name.c_str());
+        }
+    }
+
+    s->fp = fopen(SAMPLER_FILE, "w");
+    if (s->fp == NULL) {
+        panic("can't write %s", SAMPLER_FILE);
+    }
+    fprintf(s->fp, "cycle,instructions,counter,common,dstall,istall,mdu_stall,phase\n");
+    return s;
+}
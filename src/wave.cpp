@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "common.h"
+#include "wave.h"
+
+#ifdef WAVE_FST
+#include "verilated_fst_c.h"
+typedef VerilatedFstC wave_trace_t;
+#define WAVE_FILE "sim.fst"
+#else
+#include "verilated_vcd_c.h"
+typedef VerilatedVcdC wave_trace_t;
+#define WAVE_FILE "sim.vcd"
+#endif
+
+#define WAVE_WINDOW_FILE "sim-window.vcd"
+
+// streams to WAVE_FILE from the trigger on, the file is only opened then,
+// so the run before it pays no more than the model's activity tracking
+class WaveTrigger : public Wave {
+public:
+    enum { CYCLE, INST, PC } kind;
+    uint64_t at;
+    uint64_t cycles;            // 0 = until the end of the run
+
+    wave_trace_t tfp;
+    bool armed = false;         // an instruction or pc trigger fired
+    bool done = false;
+    uint64_t stop_time;
+
+    ~WaveTrigger() {
+        if (tfp.isOpen()) {
+            tfp.close();
+        }
+    }
+
+    void dump(uint64_t time) override {
+        if (!tfp.isOpen()) {
+            if (done || !(armed || (kind == CYCLE && time / 2 >= at))) {
+                return;
+            }
+            tfp.open(WAVE_FILE);
+            stop_time = time + 2 * cycles;
+            printf("[wave] tracing into %s from cycle %lu\n", WAVE_FILE, time / 2);
+        }
+        tfp.dump(time);
+        if (cycles && time >= stop_time) {
+            tfp.close();
+            done = true;
+        }
+    }
+
+    void commit(uint64_t instructions, const uint64_t *pcs, int n) override {
+        if (kind == INST && instructions >= at) {
+            armed = true;
+        }
+        for (int i = 0; kind == PC && i < n; i++) {
+            armed |= pcs[i] == at;
+        }
+    }
+
+    void flush(const char *reason) override {
+        if (tfp.isOpen()) {
+            tfp.flush();
+        }
+    }
+};
+
+Wave *wave_open_trigger(VTileForVerilator *dut, const char *trigger) {
+    WaveTrigger *wave = new WaveTrigger;
+    const char *arg = strchr(trigger, ':');
+    if (arg == NULL) {
+        panic("bad wave trigger %s", trigger);
+    }
+    if (!strncmp(trigger, "cycle:", 6)) {
+        wave->kind = WaveTrigger::CYCLE;
+    } else if (!strncmp(trigger, "inst:", 5)) {
+        wave->kind = WaveTrigger::INST;
+    } else if (!strncmp(trigger, "pc:", 3)) {
+        wave->kind = WaveTrigger::PC;
+    } else {
+        panic("bad wave trigger %s", trigger);
+    }
+    char *end;
+    wave->at = strtoull(arg + 1, &end, 0);
+    wave->cycles = *end == '+' ? strtoull(end + 1, NULL, 0) : 0;
+
+    dut->trace(&wave->tfp, 99);
+    return wave;
+}
+
+#ifndef WAVE_FST
+// the VCD "file" lives in memory: the header, then the previous and the
+// current chunk.  Verilator starts every chunk after openNext() with a full
+// dump, so the header and the two chunks are a valid VCD on their own.
+class WaveRing : public VerilatedVcdFile {
+public:
+    std::string header, prev, cur;
+
+    bool open(const std::string &name) override {
+        prev.swap(cur);
+        cur.clear();
+        return true;
+    }
+    void close() override {}
+    ssize_t write(const char *bufp, ssize_t len) override {
+        cur.append(bufp, len);
+        return len;
+    }
+};
+
+class WaveWindow : public Wave {
+public:
+    WaveRing ring;
+    VerilatedVcdC vfp{&ring};
+    uint64_t chunk_time, next_chunk;
+
+    void dump(uint64_t time) override {
+        vfp.dump(time);
+        if (time >= next_chunk) {
+            vfp.openNext(false);
+            next_chunk = time + chunk_time;
+        }
+    }
+
+    void flush(const char *reason) override {
+        vfp.flush();
+
+        FILE *fp = fopen(WAVE_WINDOW_FILE, "w");
+        if (fp == NULL) {
+            printf("[wave] can't write %s\n", WAVE_WINDOW_FILE);
+            return;
+        }
+        fwrite(ring.header.data(), 1, ring.header.size(), fp);
+        fwrite(ring.prev.data(), 1, ring.prev.size(), fp);
+        fwrite(ring.cur.data(), 1, ring.cur.size(), fp);
+        fclose(fp);
+        printf("[wave] %s, at least the last %lu cycles are in %s\n",
+               reason, chunk_time / 2, WAVE_WINDOW_FILE);
+    }
+};
+
+Wave *wave_open_window(VTileForVerilator *dut, uint64_t cycles) {
+    WaveWindow *wave = new WaveWindow;
+    dut->trace(&wave->vfp, 99);
+    wave->vfp.open(WAVE_WINDOW_FILE);
+    wave->vfp.flush();
+    wave->ring.header.swap(wave->ring.cur);
+
+    wave->chunk_time = 2 * cycles;    // two time units per cycle
+    wave->next_chunk = wave->chunk_time;
+    return wave;
+}
+#else
+Wave *wave_open_window(VTileForVerilator *dut, uint64_t cycles) {
+    panic("the wave window needs a VCD build, FST can't be kept in memory");
+}
+#endif